@@ -1,8 +1,16 @@
 #ifndef BPLUS_TREE_H
 #define BPLUS_TREE_H
 
+#include <condition_variable>
+#include <cstdint>
 #include <cstdio>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #define DEBUG
@@ -19,27 +27,236 @@
     } while (0)
 #endif
 
+// Updates applied by BPlusTree::write() all at once.
+class WriteBatch {
+ public:
+    // Keys longer than 512 bytes throw std::length_error.
+    void upsert(const std::string& key, const std::string& value);
+    void remove(const std::string& key);
+    // See BPlusTree::append_posting() and remove_posting().
+    void append_posting(const std::string& key, uint64_t posting);
+    void remove_posting(const std::string& key, uint64_t posting);
+    void clear() { ops_.clear(); }
+    size_t size() const { return ops_.size(); }
+
+ private:
+    friend class BPlusTree;
+    struct Op {
+        enum Kind { kUpsert, kRemove, kAppendPosting, kRemovePosting } kind;
+        std::string key;
+        std::string value;
+        uint64_t posting;
+    };
+    std::vector<Op> ops_;
+};
+
 class BPlusTree {
     struct Meta;
-    struct Index;
-    struct Record;
+    struct Slot;
     struct Node;
     struct IndexNode;
     struct LeafNode;
+    struct OverflowNode;
+    struct FilterNode;
     class BlockCache;
+    class WriteGuard;
+    class Wal;
+    struct Writer;
+    struct View;
 
  public:
-    BPlusTree(const char* path);
+    // How changes survive a crash, fixed when the file is created.
+    enum class CommitMode {
+        // write() syncs a redo log next to the file, other updates change
+        // the file in place.
+        kLog,
+        // Every update writes changed pages to free pages of the file and
+        // then flips the superblock, nothing to replay on open.
+        kShadow,
+    };
+
+    struct Options {
+        Options()
+                : mode(CommitMode::kLog),
+                    page_size(4096),
+                    cache_size(5 << 20),
+                    pinned_levels(2),
+                    bloom_bits_per_key(0) {}
+
+        CommitMode mode;
+        // Bytes of a node, a power of two from 4 to 16 KB. Larger pages give
+        // more fanout per read. Fixed when the file is created, an existing
+        // file keeps its own.
+        size_t page_size;
+        // Bytes of the file kept resident. Pages read once, as by a scan,
+        // are the first to go, pages read again stay.
+        size_t cache_size;
+        // Index levels from the root down which stay resident, as long as
+        // they take at most half of cache_size.
+        size_t pinned_levels;
+        // Bits per key of a Bloom filter kept in the file, 0 for none. get()
+        // of a key the filter rules out reads one cache line instead of the
+        // path to a leaf, keys which are there pay for that probe on top.
+        // With 10 bits at most about 1% of missing keys get through. Fixed
+        // when the file is created.
+        size_t bloom_bits_per_key;
+    };
+
+    // Safe to use from several threads. Writers run one at a time, readers
+    // never wait for each other and restart when a writer got in the way.
+    // Nodes carry a checksum, a call which reads a node that does not match
+    // it throws std::runtime_error.
+    BPlusTree(const char* path, const Options& options = Options());
     ~BPlusTree();
 
+    // Keys up to 512 bytes are accepted, longer ones throw std::length_error.
+    // Values of any length are accepted. In log mode upsert() and remove()
+    // change the file in place, a crash in the middle may leave the tree
+    // broken. In shadow mode each of them commits on its own.
     void upsert(const std::string& key, const std::string& value);
     bool remove(const std::string& key);
+    // Apply all updates of `batch` at once. When it returns they survive a
+    // crash, batches of concurrent callers share one commit. A batch which
+    // would update the postings of a key holding a value throws on its own
+    // before anything is applied. If an update throws otherwise, none of the
+    // batches sharing the commit is applied and all of their callers get
+    // the exception.
+    void write(const WriteBatch& batch);
     bool get(const std::string& key, std::string& value) const;
+
+    // A key may hold a sorted set of postings instead of a value, such as
+    // the places where a symbol is defined. They are stored as gaps of
+    // varints, a long list spills to overflow pages like a value does, and
+    // get() returns it in that form. Appending postings in ascending order
+    // only writes the end of the list, other changes rewrite it. Both
+    // return whether the list changed, removing the last posting removes
+    // the key. upsert() turns a list back into a value. Both throw
+    // std::invalid_argument for a key which holds a value.
+    bool append_posting(const std::string& key, uint64_t posting);
+    bool remove_posting(const std::string& key, uint64_t posting);
+    // Postings of `key` in ascending order. Throws std::invalid_argument if
+    // its value is not a posting list.
+    bool get_postings(const std::string& key,
+                                        std::vector<uint64_t>& postings) const;
+
     std::vector<std::pair<std::string, std::string>> get_range(
             const std::string& left_key, const std::string& right_key) const;
+
+    // Scan over a range in either direction, leaf nodes are read one at a
+    // time as the cursor gets there. The longer the scan runs, the more of
+    // the leaves ahead the OS is asked to read in the background. key() and
+    // value() stay valid until next().
+    class Cursor {
+     public:
+        bool valid() const { return valid_; }
+        std::string_view key() const { return key_; }
+        std::string_view value() const;
+        void next();
+
+     private:
+        friend class BPlusTree;
+        Cursor(const BPlusTree* tree, const std::string& left_key,
+                     const std::string& right_key, size_t limit, bool reverse,
+                     const View* view);
+        void seek();
+        void load();
+        void prefetch();
+
+        const BPlusTree* tree_;
+        const View* view_;               // of snapshot, or null
+        std::string bound_;              // key where the scan ends
+        size_t limit_;
+        bool reverse_;
+        size_t count_;                   // records returned so far
+        std::unique_ptr<char[]> page_;   // copy of current leaf node
+        uint64_t version_;               // of current leaf node
+        int index_;
+        std::string key_;                // last key returned, or start key
+        std::string scratch_;
+        std::string overflow_;           // value kept in overflow pages
+        bool valid_;
+        size_t leaves_;                  // siblings walked to so far
+        size_t ahead_;                   // leaves hinted beyond current one
+        off_t exhausted_;                // parent with no children left to hint
+        std::unique_ptr<char[]> parent_; // copy of parent of current leaf
+    };
+    // Cursor on keys in [left_key, right_key], at most `limit` of them. A
+    // reverse cursor starts at right_key and follows left siblings.
+    Cursor scan(const std::string& left_key, const std::string& right_key,
+                            size_t limit = SIZE_MAX, bool reverse = false) const;
+    // Cursor on keys starting with `prefix`, an empty one covers all keys.
+    Cursor scan_prefix(const std::string& prefix, size_t limit = SIZE_MAX,
+                                         bool reverse = false) const;
     bool empty() const;
     size_t size() const;
 
+    // Tree as of the last commit before the snapshot was taken, it does not
+    // change while writers go on. Pages it reads are not reused until it is
+    // destroyed, so the file may grow meanwhile. Cursors of a snapshot and
+    // the snapshot itself must not outlive their tree.
+    class Snapshot {
+     public:
+        Snapshot(Snapshot&& other) noexcept;
+        ~Snapshot();
+
+        bool get(const std::string& key, std::string& value) const;
+        bool get_postings(const std::string& key,
+                                            std::vector<uint64_t>& postings) const;
+        Cursor scan(const std::string& left_key, const std::string& right_key,
+                                size_t limit = SIZE_MAX, bool reverse = false) const;
+        Cursor scan_prefix(const std::string& prefix, size_t limit = SIZE_MAX,
+                                             bool reverse = false) const;
+        size_t size() const;
+
+     private:
+        friend class BPlusTree;
+        Snapshot(const BPlusTree* tree, View* view);
+
+        const BPlusTree* tree_;
+        View* view_;
+    };
+    // Only shadow mode keeps old pages, in log mode this throws
+    // std::logic_error.
+    Snapshot snapshot() const;
+
+    // Give freed pages at the end of file back to the file system. The
+    // filter, if any, is built again behind the last page in use.
+    void shrink_to_fit();
+    // Rebuild the tree with leaves laid out in key order from the start of
+    // file, nodes filled up to `fill_factor` of a page, then shrink_to_fit().
+    // Range scans read the file sequentially again. Overflow pages of long
+    // values stay where they are, leaves fill the pages around them.
+    // The swap is atomic, it commits as one batch: every page of the new
+    // tree is held in memory until then and, in log mode, the log gets one
+    // record about as large as the tree. Writers wait all the while, so run
+    // it when the tree is idle and there is memory for a copy of it.
+    void compact(double fill_factor = 0.9);
+    // Check the whole file with `threads` threads, as many as the hardware
+    // has by default: checksums of pages, key order within and across
+    // nodes, parent and sibling links, the key count, that the filter holds
+    // every key and that no page is used twice. Writers wait meanwhile,
+    // readers go on. Returns what is wrong, nothing when the file is intact.
+    std::vector<std::string> verify(size_t threads = 0);
+
+    // Build an empty tree from (key, value) pairs in [first, last), sorted
+    // by key without duplicates. Nodes are filled up to `fill_factor` of a
+    // page from left to right, and index levels are built bottom-up.
+    template <typename Iterator>
+    void bulk_load(Iterator first, Iterator last, double fill_factor = 0.9) {
+        bulk_load(
+                [&](std::string& key, std::string& value) {
+                    if (first == last) return false;
+                    key = first->first;
+                    value = first->second;
+                    ++first;
+                    return true;
+                },
+                fill_factor);
+    }
+    // Same as above, `next` yields pairs until it returns false.
+    void bulk_load(const std::function<bool(std::string&, std::string&)>& next,
+                                 double fill_factor = 0.9);
+
 #ifdef DEBUG
     void dump();
 #endif
@@ -48,28 +265,64 @@ class BPlusTree {
     template <typename T>
     T* map(off_t offset) const;
     template <typename T>
+    const T* peek(off_t offset) const;
+    template <typename T>
     void unmap(T* map_obj) const;
     template <typename T>
     T* alloc();
     template <typename T>
     void dealloc(T* node);
 
-    constexpr size_t get_min_keys() const;
-    constexpr size_t get_max_keys() const;
-
     template <typename T>
-    int upper_bound(T arr[], int n, const char* target) const;
+    int upper_bound(const T* node, int n, std::string_view target) const;
     template <typename T>
-    int lower_bound(T arr[], int n, const char* target) const;
-
-    off_t get_leaf_offset(const char* key) const;
-    LeafNode* split_leaf_node(LeafNode* leaf_node);
-    IndexNode* split_index_node(IndexNode* index_node);
-    size_t insert_key_into_index_node(IndexNode* index_node, const char* key,
-                                    Node* left_node, Node* right_node);
-    size_t insert_kv_into_leaf_node(LeafNode* leaf_node, const char* key,
-                                const char* value);
-    int get_index_from_leaf_node(LeafNode* leaf_node, const char* key) const;
+    int lower_bound(const T* node, int n, std::string_view target) const;
+
+    std::string make_record(const std::string& key, const std::string& value,
+                                                    uint16_t flags = 0);
+    off_t write_overflow(std::string_view value);
+    bool read_value(const LeafNode* leaf_node, int index, uint64_t version,
+                                    std::string& value, const View* view) const;
+    void free_value(const LeafNode* leaf_node, int index);
+    std::set<off_t> free_pages() const;
+    void set_free_pages(const std::set<off_t>& pages);
+    std::pair<off_t, size_t> build(const std::function<bool(std::string&)>& next,
+                                                                 double fill_factor);
+
+    bool read_node(off_t offset, off_t of_parent, uint64_t parent_version,
+                                 char* page, uint64_t& version, const View* view,
+                                 bool pin = false) const;
+    bool read_leaf(std::string_view key, char* page, uint64_t& version,
+                                 const View* view) const;
+    bool get(const std::string& key, std::string& value, const View* view,
+                     uint16_t* flags = nullptr) const;
+    bool get_postings(const std::string& key, std::vector<uint64_t>& postings,
+                                        const View* view) const;
+    size_t size(const View* view) const;
+    static std::string prefix_end(const std::string& prefix);
+
+    void insert(const std::string& key, const std::string& value,
+                            uint16_t flags = 0);
+    bool erase(const std::string& key);
+    bool update_postings(const std::string& key, uint64_t posting, bool add);
+    bool holds_value(const std::string& key) const;
+    void checkpoint();
+
+    bool filter_excludes(std::string_view key, const View* view) const;
+    void add_to_filter(std::string_view key);
+    void rebuild_filter();
+
+    off_t get_leaf_offset(std::string_view key) const;
+    LeafNode* split_leaf_node(LeafNode* leaf_node, int index,
+                                                        std::string_view record);
+    IndexNode* split_index_node(IndexNode* index_node, std::string& key,
+                                                            off_t of_left, off_t of_right);
+    bool insert_key_into_index_node(IndexNode* index_node, std::string_view key,
+                                                                    off_t of_left, off_t of_right);
+    int insert_kv_into_leaf_node(LeafNode* leaf_node, std::string_view key,
+                                                             std::string_view record);
+    int get_index_from_leaf_node(const LeafNode* leaf_node,
+                                                             std::string_view key) const;
     IndexNode* get_or_create_parent(Node* node);
 
     bool borrow_from_left_leaf_sibling(LeafNode* leaf_node);
@@ -77,18 +330,24 @@ class BPlusTree {
     bool borrow_from_leaf_sibling(LeafNode* leaf_node);
     bool merge_left_leaf(LeafNode* leaf_node);
     bool merge_right_leaf(LeafNode* leaf_node);
-    LeafNode* merge_leaf(LeafNode* leaf_node);
+    bool merge_leaf(LeafNode* leaf_node);
 
     bool borrow_from_left_index_sibling(IndexNode* index_node);
     bool borrow_from_right_index_sibling(IndexNode* index_node);
     bool borrow_from_index_sibling(IndexNode* index_node);
     bool merge_left_index(IndexNode* index_node);
     bool merge_right_index(IndexNode* index_node);
-    IndexNode* merge_index(IndexNode* index_node);
+    bool merge_index(IndexNode* index_node);
 
     int fd_;
     BlockCache* block_cache_;
     Meta* meta_;
+    std::mutex write_mutex_;
+    Wal* wal_;
+    std::mutex queue_mutex_;
+    std::deque<Writer*> writers_;    // callers of write() in order
+    size_t page_size_;
+    size_t pinned_levels_;
 };
 
 #endif    // BPLUS_TREE_H
\ No newline at end of file
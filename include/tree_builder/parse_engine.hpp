@@ -0,0 +1,90 @@
+#ifndef PARSE_ENGINE_H
+#define PARSE_ENGINE_H
+
+#include <tree_builder/tree_builder.hpp>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct TreeDeleter {
+    void operator()(TSTree *tree) const { ts_tree_delete(tree); }
+};
+
+// One parsed file. error is empty when the file was parsed and the callback
+// succeeded, tree then holds the file's tree unless the callback released
+// it. Otherwise error says why and tree is empty.
+struct ParseResult {
+    std::string path;
+    Language language;
+    std::unique_ptr<SourceFile> source;
+    std::unique_ptr<TSTree, TreeDeleter> tree;
+    std::string error;
+};
+
+// Parses many files on a pool of threads. Each worker keeps its own queue
+// and steals from the others once it runs dry, and has one parser per
+// language. Results come out of next() as files finish, not in the order
+// they were submitted.
+class ParseEngine {
+public:
+    // Runs on the worker right after a file is parsed, with that worker's
+    // builder for the file's language, so extraction is spread over the pool
+    // too. It may release the tree or source to keep only what it extracted.
+    typedef std::function<void(TreeBuilder &builder, ParseResult &result)> Callback;
+
+    // threads 0 means one per core. At most max_results finished files wait
+    // for next() before the workers stop to let the caller catch up.
+    explicit ParseEngine(size_t threads = 0, Callback callback = nullptr,
+                         size_t max_results = 0);
+    // Drops files not parsed yet and results not taken yet.
+    ~ParseEngine();
+    ParseEngine(const ParseEngine &) = delete;
+    ParseEngine &operator=(const ParseEngine &) = delete;
+
+    void submit(std::string path, Language language);
+    // No more files will be submitted, next() returns false after the last.
+    void close();
+    // Waits for the next finished file. Returns false once closed and every
+    // file has been returned. Several threads may wait in it at once.
+    bool next(ParseResult &result);
+
+    size_t threads() const { return threads_.size(); }
+
+private:
+    struct Job {
+        std::string path;
+        Language language;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Job> jobs;
+    };
+
+    void work(size_t index);
+    bool take(size_t index, Job &job);
+
+    Callback callback_;
+    size_t max_results_;
+    std::vector<std::unique_ptr<Queue>> queues_;
+    std::vector<std::thread> threads_;
+    std::atomic<size_t> next_queue_;
+    std::atomic<size_t> queued_;
+
+    std::mutex mutex_;
+    std::condition_variable work_cv_;
+    std::condition_variable result_cv_;
+    std::condition_variable space_cv_;
+    std::deque<ParseResult> results_;
+    size_t outstanding_;
+    bool closed_;
+    bool stopping_;
+};
+
+#endif // PARSE_ENGINE_H
@@ -0,0 +1,67 @@
+#ifndef REPO_WALKER_H
+#define REPO_WALKER_H
+
+#include <tree_builder/tree_builder.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// A source file found by the walker.
+struct WalkItem {
+    std::string path;
+    Language language;
+    uint64_t size;
+};
+
+// Language of a path by its extension, false when there is none we parse.
+bool detect_language(const std::string &path, Language &language);
+
+// Finds the source files under a directory on a pool of threads, skipping
+// what git would ignore, vendored trees, binaries and oversized files.
+class RepoWalker {
+public:
+    struct Options {
+        Options()
+                : threads(0),
+                    batch_size(256),
+                    max_file_size(1 << 20),
+                    skip_binary(true),
+                    use_gitignore(true),
+                    skip_dirs({".git", ".hg", ".svn", "node_modules", "vendor",
+                               "third_party", "bower_components", "__pycache__"}) {}
+
+        // Threads reading directories, 0 for one per core.
+        size_t threads;
+        // Files handed over per call of the batch callback.
+        size_t batch_size;
+        // Larger files are skipped, mostly generated or minified code.
+        uint64_t max_file_size;
+        // Skip files with a NUL byte near the start. Costs a read of the
+        // first block of each file, which the parser reads again from cache.
+        bool skip_binary;
+        // Apply the .gitignore files found on the way down.
+        bool use_gitignore;
+        // Directory names never entered, at any depth.
+        std::vector<std::string> skip_dirs;
+        // More .gitignore style patterns, relative to the root.
+        std::vector<std::string> ignore;
+    };
+
+    // Called with each full batch and the last partial ones, from the walker
+    // threads but never two at a time. It may take the items out.
+    typedef std::function<void(std::vector<WalkItem> &batch)> BatchCallback;
+
+    explicit RepoWalker(const Options &options = Options());
+
+    // Walks root and returns the number of files passed to emit. Throws
+    // std::runtime_error when root is not a directory, directories further
+    // down which cannot be read are skipped.
+    size_t walk(const std::string &root, const BatchCallback &emit);
+
+private:
+    Options options_;
+};
+
+#endif // REPO_WALKER_H
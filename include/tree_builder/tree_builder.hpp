@@ -6,6 +6,7 @@
 #include <tree_sitter/api.h>
 #include <vector>
 #include <cstdio>
+#include <stdexcept>
 #include <string>
 
 #ifdef _WIN32
@@ -30,7 +31,7 @@ typedef struct {
     size_t buffer_size;
 }FilePayload;
 
-const char *file_read_helper(void *payload, uint32_t byte_index,
+inline const char *file_read_helper(void *payload, uint32_t byte_index,
                             TSPoint position, uint32_t *bytes_read) {
 
     FilePayload *fp = (FilePayload *)payload;
@@ -44,6 +45,27 @@ const char *file_read_helper(void *payload, uint32_t byte_index,
     return *bytes_read > 0 ? fp->buffer : NULL;
 }
 
+// Whole contents of a source file, read in one go or mapped when large, and
+// released along with the object. Throws std::runtime_error when the file
+// cannot be read.
+class SourceFile {
+public:
+    explicit SourceFile(const char *path);
+    ~SourceFile();
+    SourceFile(SourceFile &&other) noexcept;
+    SourceFile(const SourceFile &) = delete;
+    SourceFile &operator=(const SourceFile &) = delete;
+
+    const char *data() const { return data_; }
+    size_t size() const { return size_; }
+
+private:
+    const char *data_;
+    size_t size_;
+    bool mapped_;
+    std::vector<char> buffer_;
+};
+
 class TreeBuilder {
 public:
     TreeBuilder(const Language lang);
@@ -68,12 +90,26 @@ public:
         return file;
     }
     
+    // Reads the file a chunk at a time through file_read_helper, release
+    // the payload with free_payload() once the tree is built.
     FilePayload load_file_to_payload(FILE* file);
+    void free_payload(FilePayload *payload);
     TSInput construct_parser_input(FilePayload* payload);
     TSTree *build_tree(TSInput input);
+    // Parse the whole file from memory, no callbacks or copies.
+    TSTree *build_tree(const SourceFile &source);
+    // Parse text again reusing old_tree, which must already have been told
+    // about the edits with ts_tree_edit().
+    TSTree *reparse(TSTree *old_tree, const std::string &text);
     void delete_tree(TSTree *tree);
     TSNode get_root_node(TSTree *tree);
-    std::vector<TSPoint> query(TSTree *tree, const std::string &query_str); 
+    // Query for the builder's language, compiled on first use and shared by
+    // all builders and threads from then on. Throws std::runtime_error when
+    // it does not compile.
+    const TSQuery *compile_query(const std::string &query_str);
+    // Start points of all captures of the query, run with a cursor kept per
+    // thread.
+    std::vector<TSPoint> query(TSTree *tree, const std::string &query_str);
 
     void print(TSTree *tree);
 
@@ -83,4 +119,29 @@ private:
     const TSLanguage *language;
 };
 
+// A file kept parsed while it is being edited. Every edit is applied to the
+// previous tree and only the affected part of the file is parsed again.
+// Shares the builder's parser, so use it from the builder's thread only.
+class OpenFile {
+public:
+    OpenFile(TreeBuilder &builder, std::string text);
+    OpenFile(TreeBuilder &builder, const SourceFile &source);
+    ~OpenFile();
+    OpenFile(const OpenFile &) = delete;
+    OpenFile &operator=(const OpenFile &) = delete;
+
+    // Replace bytes [start, old_end) with text and reparse. Returns the
+    // ranges of the new tree whose syntax or text changed, sorted and
+    // without overlaps. Throws std::out_of_range for a bad range.
+    std::vector<TSRange> edit(uint32_t start, uint32_t old_end, const std::string &text);
+
+    TSTree *tree() const { return tree_; }
+    const std::string &text() const { return text_; }
+
+private:
+    TreeBuilder &builder_;
+    std::string text_;
+    TSTree *tree_;
+};
+
 #endif // TREE_BUILDER_H
\ No newline at end of file
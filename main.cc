@@ -23,6 +23,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <iostream>
+#include <thread>
+#include <tree_builder/parse_engine.hpp>
+#include <tree_builder/repo_walker.hpp>
 #include <tree_builder/tree_builder.hpp>
 #include <tree_sitter/tree-sitter-tsx.h>
 
@@ -37,12 +40,48 @@ void print_captures(TSQueryCursor *cursor) {
     }
 }
 
-int main() {
+// Parse every source file under root, files are found while others parse.
+int index_directory(const char *root) {
+    ParseEngine engine;
+    bool walked = true;
+    std::thread walker([&] {
+        try {
+            RepoWalker().walk(root, [&](std::vector<WalkItem> &batch) {
+                for (WalkItem &item : batch) {
+                    engine.submit(std::move(item.path), item.language);
+                }
+            });
+        } catch (const std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            walked = false;
+        }
+        engine.close();
+    });
+
+    ParseResult result;
+    size_t parsed = 0, failed = 0;
+    while (engine.next(result)) {
+        if (result.error.empty()) {
+            parsed++;
+        } else {
+            failed++;
+            std::cerr << result.path << ": " << result.error << std::endl;
+        }
+    }
+    walker.join();
+
+    std::cout << "parsed " << parsed << " files, " << failed << " failed" << std::endl;
+    return walked && failed == 0 ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc > 1) {
+        return index_directory(argv[1]);
+    }
+
     TreeBuilder builder = TreeBuilder(TREE_BUILDER_LANGUAGE_TYPESCRIPT);
-    FILE *file = builder.open_file("./source.tsx");
-    FilePayload payload = builder.load_file_to_payload(file);
-    TSInput input = builder.construct_parser_input(&payload);
-    TSTree *tree = builder.build_tree(input);
+    SourceFile source("./source.tsx");
+    TSTree *tree = builder.build_tree(source);
 
     builder.print(tree);
 
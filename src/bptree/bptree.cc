@@ -1,8 +1,33 @@
 #include "bptree/bptree.hpp"
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bitset>
 #include <cassert>
+#include <cstddef>
+#include <cstdint>
 #include <cstring>
-#include <unordered_map>
+#include <exception>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
 
 #ifdef _WIN32
 #include <windows.h>
@@ -15,14 +40,138 @@
 #endif
 
 const off_t kMetaOffset = 0;
-const int kOrder = 32;
-static_assert(kOrder >= 3,
-                            "The order of B+Tree should be greater than or equal to 3.");
-const int kMaxKeySize = 32;
-const int kMaxValueSize = 256;
-const int kMaxCacheSize = 1024 *    1024 * 5;
-typedef char Key[kMaxKeySize];
-typedef char Value[kMaxValueSize];
+// Page size is a power of two between these, chosen when the file is
+// created.
+const size_t kMinPageSize = 4096;
+const size_t kMaxPageSize = 1 << 14;
+const size_t kMaxKeySize = kMinPageSize / 8;
+// File is mapped by regions, grown by chunks and kept resident by extents.
+const size_t kRegionSize = 1 << 26;
+const size_t kGrowSize = 1 << 20;
+const size_t kExtentSize = 1 << 16;
+// Most leaf nodes a scan asks the OS to read ahead.
+const size_t kMaxPrefetch = 32;
+// Log is checkpointed into the data file once it grows beyond this.
+const off_t kMaxWalSize = 1 << 24;
+
+// Shortest key which is greater than `left` and not greater than `right`.
+std::string ShortestSeparator(std::string_view left, std::string_view right) {
+    assert(left < right);
+    size_t n = std::min(left.size(), right.size()), i = 0;
+    while (i < n && left[i] == right[i]) ++i;
+    return std::string(right.substr(0, i + 1));
+}
+
+// FNV-1a, enough to tell a torn record from a complete one.
+uint64_t Checksum(const char* data, size_t size) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; ++i) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// A posting list is the last posting in 8 bytes followed by the gaps
+// between sorted postings, starting from 0. Gaps are varints of seven bits
+// per byte with the high bit set on all but the last byte.
+void PutVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+std::string EncodePostings(const std::vector<uint64_t>& postings) {
+    assert(!postings.empty());
+    std::string out(sizeof(uint64_t), '\0');
+    std::memcpy(&out[0], &postings.back(), sizeof(uint64_t));
+    uint64_t prev = 0;
+    for (uint64_t posting : postings) {
+        PutVarint(out, posting - prev);
+        prev = posting;
+    }
+    return out;
+}
+
+void DecodePostings(std::string_view in, std::vector<uint64_t>& postings) {
+    postings.clear();
+    uint64_t last = 0, prev = 0;
+    bool valid = in.size() > sizeof(last);
+    if (valid) std::memcpy(&last, in.data(), sizeof(last));
+    for (size_t i = sizeof(last); valid && i < in.size();) {
+        uint64_t v = 0;
+        for (int shift = 0; valid; shift += 7) {
+            valid = i < in.size() && shift <= 63;
+            if (!valid) break;
+            unsigned char byte = static_cast<unsigned char>(in[i++]);
+            v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) break;
+        }
+        valid = valid && (postings.empty() || v != 0);
+        prev += v;
+        postings.push_back(prev);
+    }
+    if (!valid || prev != last) {
+        throw std::invalid_argument("value is not a posting list");
+    }
+}
+
+uint32_t Crc32cSoftware(uint32_t crc, const unsigned char* data, size_t size) {
+    static const std::array<uint32_t, 256> table = [] {
+        std::array<uint32_t, 256> t;
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+            t[i] = c;
+        }
+        return t;
+    }();
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+__attribute__((target("sse4.2")))
+uint32_t Crc32cHardware(uint32_t crc, const unsigned char* data, size_t size) {
+    uint64_t c = crc;
+    for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        c = _mm_crc32_u64(c, word);
+    }
+    crc = static_cast<uint32_t>(c);
+    for (; size > 0; ++data, --size) crc = _mm_crc32_u8(crc, *data);
+    return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+uint32_t Crc32cHardware(uint32_t crc, const unsigned char* data, size_t size) {
+    for (; size >= sizeof(uint64_t); data += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+        uint64_t word;
+        std::memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; ++data, --size) crc = __crc32cb(crc, *data);
+    return crc;
+}
+#endif
+
+// CRC32C of `data` continuing from `crc`, with the instructions of the CPU
+// where it has them.
+uint32_t Crc32c(const char* data, size_t size, uint32_t crc = 0) {
+    auto bytes = reinterpret_cast<const unsigned char*>(data);
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+    static const bool hardware = __builtin_cpu_supports("sse4.2");
+    return ~(hardware ? Crc32cHardware(~crc, bytes, size)
+                                        : Crc32cSoftware(~crc, bytes, size));
+#elif defined(__ARM_FEATURE_CRC32)
+    return ~Crc32cHardware(~crc, bytes, size);
+#else
+    return ~Crc32cSoftware(~crc, bytes, size);
+#endif
+}
 
 void Exit(const char* msg) {
 #ifdef _WIN32
@@ -39,37 +188,37 @@ struct BPlusTree::Meta {
     off_t block;        // offset of next new node
     size_t height;    // height of B+Tree
     size_t size;        // key size
+    off_t free_page;    // head of freed pages
+    size_t page_size;   // bytes of page
+    off_t filter;       // first page of Bloom filter, or 0
+    size_t filter_pages;
+    size_t filter_bits;  // bits per key, 0 without filter
+    size_t filter_keys;  // keys set in the filter, removed ones included
 };
 
-struct BPlusTree::Index {
-    Index() : offset(0) { std::memset(key, 0, sizeof(key)); }
-
-    off_t offset;
-    Key key;
-
-    void UpdateIndex(off_t of, const char* k) {
-        offset = of;
-        strncpy(key, k, kMaxKeySize);
-    }
-    void UpdateKey(const char* k) { strncpy(key, k, kMaxKeySize); }
-};
-
-struct BPlusTree::Record {
-    Key key;
-    Value value;
-
-    void UpdateKV(const char* k, const char* v) {
-        strncpy(key, k, kMaxKeySize);
-        strncpy(value, v, kMaxValueSize);
-    }
-    void UpdateKey(const char* k) { strncpy(key, k, kMaxKeySize); }
-    void UpdateValue(const char* v) { strncpy(value, v, kMaxValueSize); }
+// Every node is one page. A slot directory grows from the header towards
+// the end of page, and cells are allocated from the end of page backwards.
+// Keys of a node share a prefix which is stored once at the very end of
+// page, cells only keep what follows it. Each slot also keeps the first
+// bytes of its key as a hint, so a search mostly scans slots and only
+// reads cells whose hint ties with the target.
+struct BPlusTree::Slot {
+    uint16_t offset;    // offset of cell inside the page
+    uint16_t size;      // size of cell
+    uint32_t hint;      // first 4 bytes of key without prefix, big endian
 };
 
 struct BPlusTree::Node {
-    Node() : parent(0), left(0), right(0), count(0) {}
-    Node(off_t parent_, off_t leaf_, off_t right_, size_t count_)
-            : parent(parent_), left(leaf_), right(right_), count(count_) {}
+    explicit Node(size_t size)
+            : parent(0),
+                left(0),
+                right(0),
+                count(0),
+                heap(static_cast<uint32_t>(size)),
+                frag(0),
+                prefix(0),
+                page_size(static_cast<uint32_t>(size)),
+                checksum(0) {}
     ~Node() = default;
 
     off_t offset;    // offset of self
@@ -77,382 +226,1969 @@ struct BPlusTree::Node {
     off_t left;        // offset of left node(may be sibling)
     off_t right;     // offset of right node(may be sibling)
     size_t count;    // count of keys
+    uint32_t heap;   // offset of the lowest cell
+    uint32_t frag;   // bytes of dead cells above heap
+    uint32_t prefix; // size of prefix shared by all keys
+    uint32_t page_size; // bytes of page
+    uint32_t checksum;  // CRC32C of page without this field, 0 if not sealed
+
+    size_t Capacity() const { return page_size - sizeof(Node); }
+
+    // Checksum of a page of `size` bytes, which is not taken from the
+    // header as that may be what is broken.
+    uint32_t Sum(size_t size) const {
+        const char* page = reinterpret_cast<const char*>(this);
+        const size_t end = offsetof(Node, checksum) + sizeof(checksum);
+        return Crc32c(page + end, size - end,
+                                    Crc32c(page, offsetof(Node, checksum)));
+    }
+
+    // Whether the header, `n` slots and their cells lie inside a page of
+    // `size` bytes.
+    bool Intact(size_t n, size_t size) const {
+        if (page_size != size || prefix > size || heap > size - prefix ||
+                n > size / sizeof(Slot) || heap < sizeof(Node) + n * sizeof(Slot)) {
+            return false;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            const Slot& slot = Slots()[i];
+            if (slot.offset < heap || slot.offset + slot.size > size - prefix) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static size_t CommonPrefix(std::string_view a, std::string_view b) {
+        size_t n = std::min(a.size(), b.size()), i = 0;
+        while (i < n && a[i] == b[i]) ++i;
+        return i;
+    }
+
+    std::string_view Prefix() const {
+        return std::string_view(
+                reinterpret_cast<const char*>(this) + page_size - prefix, prefix);
+    }
+
+    bool HasPrefix(std::string_view k) const {
+        return k.size() >= prefix && k.compare(0, prefix, Prefix()) == 0;
+    }
+
+    Slot* Slots() { return reinterpret_cast<Slot*>(this + 1); }
+    const Slot* Slots() const { return reinterpret_cast<const Slot*>(this + 1); }
+
+    char* Cell(int slot) {
+        return reinterpret_cast<char*>(this) + Slots()[slot].offset;
+    }
+    const char* Cell(int slot) const {
+        return reinterpret_cast<const char*>(this) + Slots()[slot].offset;
+    }
+    size_t CellSize(int slot) const { return Slots()[slot].size; }
+
+    // Bytes taken by the prefix, `n` slots and their cells.
+    size_t UsedSpace(size_t n) const { return Capacity() - FreeSpace(n); }
+
+    // Bytes still available for new slots and cells, including dead cells.
+    size_t FreeSpace(size_t n) const {
+        return heap + frag - sizeof(Node) - n * sizeof(Slot);
+    }
+
+    bool Fits(size_t n, size_t size) const {
+        return FreeSpace(n) >= size + sizeof(Slot);
+    }
+
+    // Keys ordered by their hints are ordered the same way, ties aside.
+    static uint32_t Hint(std::string_view k) {
+        uint32_t hint = 0;
+        for (size_t i = 0; i < sizeof(hint); ++i) {
+            hint = hint << 8 | (i < k.size() ? static_cast<uint8_t>(k[i]) : 0);
+        }
+        return hint;
+    }
+
+    // Narrow slots [0, n) down to [l, r) by hints, keys before l are less
+    // than a key with `hint` and keys from r on are greater. A binary search
+    // on hints leaves a few slots, which are compared at once.
+    void HintRange(int n, uint32_t hint, int& l, int& r) const {
+        const Slot* slots = Slots();
+        l = 0;
+        r = n;
+        while (r - l > 8) {
+            int mid = (l + r) >> 1;
+            if (slots[mid].hint < hint) {
+                l = mid + 1;
+            } else if (slots[mid].hint > hint) {
+                r = mid;
+            } else {
+                // Ties are left to full compares.
+                return;
+            }
+        }
+        int less, equal;
+        CountHints(slots + l, r - l, hint, less, equal);
+        l += less;
+        r = l + equal;
+    }
+
+    // Count `n` slots with hint below `hint` and equal to it.
+    static void CountHints(const Slot* slots, int n, uint32_t hint, int& less,
+                                                 int& equal) {
+        int i = 0;
+        less = equal = 0;
+#if defined(__AVX2__) || defined(__SSE2__) || defined(_M_X64)
+        // Hints are the odd 32-bit lanes. Compares are signed, so sign bits
+        // are flipped first.
+        const __m128i bias = _mm_set1_epi32(INT32_MIN);
+        const __m128i target =
+                _mm_xor_si128(_mm_set1_epi32(static_cast<int32_t>(hint)), bias);
+#if defined(__AVX2__)
+        const __m256i bias8 = _mm256_set1_epi32(INT32_MIN);
+        const __m256i target8 = _mm256_set_m128i(target, target);
+        for (; i + 4 <= n; i += 4) {
+            __m256i v = _mm256_xor_si256(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i*>(slots + i)),
+                    bias8);
+            less += std::bitset<8>(_mm256_movemask_ps(_mm256_castsi256_ps(
+                                                              _mm256_cmpgt_epi32(target8, v))) &
+                                                          0xAA)
+                                .count();
+            equal += std::bitset<8>(_mm256_movemask_ps(_mm256_castsi256_ps(
+                                                                _mm256_cmpeq_epi32(target8, v))) &
+                                                            0xAA)
+                                 .count();
+        }
+#endif
+        for (; i + 2 <= n; i += 2) {
+            __m128i v = _mm_xor_si128(
+                    _mm_loadu_si128(reinterpret_cast<const __m128i*>(slots + i)), bias);
+            less += std::bitset<4>(_mm_movemask_ps(_mm_castsi128_ps(
+                                                           _mm_cmpgt_epi32(target, v))) &
+                                                       0xA)
+                                .count();
+            equal += std::bitset<4>(_mm_movemask_ps(_mm_castsi128_ps(
+                                                             _mm_cmpeq_epi32(target, v))) &
+                                                         0xA)
+                                 .count();
+        }
+#endif
+        for (; i < n; ++i) {
+            less += slots[i].hint < hint;
+            equal += slots[i].hint == hint;
+        }
+    }
+
+    // Insert a cell of `size` bytes as slot `index` of `n` slots and return it.
+    // `k` is its key without prefix.
+    char* InsertCell(size_t n, int index, size_t size, std::string_view k) {
+        assert(Fits(n, size));
+        uint32_t hint = Hint(k);
+        if (heap < sizeof(Node) + (n + 1) * sizeof(Slot) + size) Compact(n);
+        heap -= size;
+        std::memmove(&Slots()[index + 1], &Slots()[index],
+                                 sizeof(Slot) * (n - index));
+        Slots()[index].offset = static_cast<uint16_t>(heap);
+        Slots()[index].size = static_cast<uint16_t>(size);
+        Slots()[index].hint = hint;
+        return Cell(index);
+    }
+
+    void RemoveCell(size_t n, int index) {
+        if (Slots()[index].offset == heap) {
+            heap += Slots()[index].size;
+        } else {
+            frag += Slots()[index].size;
+        }
+        std::memmove(&Slots()[index], &Slots()[index + 1],
+                                 sizeof(Slot) * (n - index - 1));
+    }
+
+    // Move all live cells to the end of page so free space is contiguous.
+    void Compact(size_t n) {
+        char page[kMaxPageSize];
+        std::memcpy(page, this, page_size);
+        heap = page_size - prefix;
+        frag = 0;
+        for (size_t i = 0; i < n; ++i) {
+            Slot& slot = Slots()[i];
+            heap -= slot.size;
+            std::memcpy(reinterpret_cast<char*>(this) + heap, &page[slot.offset],
+                                    slot.size);
+            slot.offset = static_cast<uint16_t>(heap);
+        }
+    }
+
+    // Drop all cells, keys stored afterwards share prefix `p`.
+    void Reset(std::string_view p = std::string_view()) {
+        count = 0;
+        frag = 0;
+        prefix = static_cast<uint32_t>(p.size());
+        heap = page_size - prefix;
+        if (!p.empty()) {
+            std::memmove(reinterpret_cast<char*>(this) + heap, p.data(), p.size());
+        }
+    }
 };
 
+// Cell of index node: | child offset | key size | key without prefix |
+// An index node with `count` keys has `count + 1` cells, the key of the
+// last cell is always empty.
 struct BPlusTree::IndexNode : BPlusTree::Node {
-    IndexNode() = default;
+    explicit IndexNode(size_t page_size) : Node(page_size) {}
     ~IndexNode() = default;
 
-    const char* FirstKey() const {
-        assert(count > 0);
-        return indexes[0].key;
+    // Children with their full keys.
+    typedef std::vector<std::pair<std::string, off_t>> Cells;
+
+    static constexpr size_t kHeaderSize = sizeof(off_t) + sizeof(uint16_t);
+
+    // Bytes taken by a cell with a key of `key_size` and its slot.
+    static size_t CellSpace(size_t key_size) {
+        return kHeaderSize + key_size + sizeof(Slot);
+    }
+
+    // Bytes needed to store cells[begin, end) in one node.
+    static size_t PackedSize(const Cells& cells, size_t begin, size_t end) {
+        if (end - begin < 2) return CellSpace(0);
+        size_t p = CommonPrefix(cells[begin].first, cells[end - 2].first);
+        size_t size = p + CellSpace(0);
+        for (size_t i = begin; i + 1 < end; ++i) {
+            size += CellSpace(cells[i].first.size() - p);
+        }
+        return size;
     }
 
-    const char* LastKey() const {
+    std::string FirstKey() const {
         assert(count > 0);
-        return indexes[count - 1].key;
+        return Key(0);
     }
 
-    const char* Key(int index) const {
+    std::string LastKey() const {
         assert(count > 0);
+        return Key(count - 1);
+    }
+
+    std::string_view Suffix(int index) const {
         assert(index >= 0);
-        assert(index <= kOrder);
-        return indexes[index].key;
+        assert(index < static_cast<int>(count));
+        const char* cell = Cell(index);
+        uint16_t key_size;
+        std::memcpy(&key_size, cell + sizeof(off_t), sizeof(key_size));
+        return std::string_view(cell + kHeaderSize, key_size);
     }
 
-    void UpdateKey(int index, const char* k) {
+    std::string Key(int index) const {
         assert(index >= 0);
-        assert(index <= kOrder);
-        indexes[index].UpdateKey(k);
+        assert(index <= static_cast<int>(count));
+        if (index == static_cast<int>(count)) return std::string();
+        std::string key(Prefix());
+        key.append(Suffix(index));
+        return key;
     }
 
-    void UpdateOffset(int index, off_t offset) {
+    // Whether slots and cells lie inside a page of `size` bytes.
+    bool Intact(size_t size) const {
+        if (!Node::Intact(count + 1, size)) return false;
+        for (size_t i = 0; i <= count; ++i) {
+            if (CellSize(i) < kHeaderSize) return false;
+            if (i < count && kHeaderSize + Suffix(i).size() > CellSize(i)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    off_t Child(int index) const {
         assert(index >= 0);
-        assert(index <= kOrder);
-        indexes[index].offset = offset;
+        assert(index <= static_cast<int>(count));
+        off_t offset;
+        std::memcpy(&offset, Cell(index), sizeof(offset));
+        return offset;
     }
 
-    void UpdateIndex(int index, const char* k, off_t offset) {
+    void UpdateOffset(int index, off_t offset) {
         assert(index >= 0);
-        assert(index <= kOrder);
-        UpdateKey(index, k);
-        UpdateOffset(index, offset);
+        assert(index <= static_cast<int>(count));
+        std::memcpy(Cell(index), &offset, sizeof(offset));
+    }
+
+    int ChildIndex(off_t offset) const {
+        for (size_t i = 0; i <= count; ++i) {
+            if (Child(i) == offset) return i;
+        }
+        assert(false);
+        return -1;
+    }
+
+    Cells AllCells() const {
+        Cells cells;
+        cells.reserve(count + 2);
+        for (size_t i = 0; i <= count; ++i) cells.emplace_back(Key(i), Child(i));
+        return cells;
+    }
+
+    // Refill node with cells[begin, end), the key of the last one is dropped.
+    void Rebuild(const Cells& cells, size_t begin, size_t end) {
+        assert(end > begin);
+        assert(PackedSize(cells, begin, end) <= Capacity());
+        size_t p = end - begin < 2
+                                     ? 0
+                                     : CommonPrefix(cells[begin].first, cells[end - 2].first);
+        Reset(std::string_view(cells[begin].first).substr(0, p));
+        for (size_t i = begin; i < end; ++i) {
+            std::string_view k(cells[i].first);
+            PutCell(i - begin, i - begin,
+                            i + 1 < end ? k.substr(p) : std::string_view(),
+                            cells[i].second);
+        }
+        count = end - begin - 1;
+    }
+
+    bool CanUpdateKey(int index, std::string_view k) const {
+        if (HasPrefix(k)) {
+            return FreeSpace(count + 1) + Suffix(index).size() >= k.size() - prefix;
+        }
+        Cells cells = AllCells();
+        cells[index].first = k;
+        return PackedSize(cells, 0, cells.size()) <= Capacity();
+    }
+
+    void UpdateKey(int index, std::string_view k) {
+        assert(index < static_cast<int>(count));
+        assert(CanUpdateKey(index, k));
+        if (!HasPrefix(k)) {
+            Cells cells = AllCells();
+            cells[index].first = k;
+            Rebuild(cells, 0, cells.size());
+            return;
+        }
+        off_t offset = Child(index);
+        RemoveCell(count + 1, index);
+        PutCell(count, index, k.substr(prefix), offset);
     }
 
     void DeleteKeyAtIndex(int index) {
         assert(index >= 0);
-        assert(index <= kOrder);
-        std::memmove(&indexes[index], &indexes[index + 1],
-                                 sizeof(indexes[0]) * (count-- - index));
+        assert(index < static_cast<int>(count));
+        RemoveCell(count-- + 1, index);
     }
 
-    void InsertKeyAtIndex(int index, const char* k) {
-        assert(index >= 0);
-        assert(index <= kOrder);
-        std::memmove(&indexes[index + 1], &indexes[index],
-                                 sizeof(indexes[0]) * (++count - index));
-        UpdateKey(index, k);
+    bool CanInsertKey(std::string_view k) const {
+        if (HasPrefix(k)) {
+            return FreeSpace(count + 1) >= CellSpace(k.size() - prefix);
+        }
+        // Prefix gets shorter and every stored key grows by the difference.
+        size_t p = CommonPrefix(k, Prefix());
+        return UsedSpace(count + 1) - prefix + p + count * (prefix - p) +
+                             CellSpace(k.size() - p) <=
+                     Capacity();
     }
 
-    void InsertIndexAtIndex(int index, const char* k, off_t offset) {
+    void InsertIndexAtIndex(int index, std::string_view k, off_t offset) {
         assert(index >= 0);
-        assert(index <= kOrder);
-        std::memmove(&indexes[index + 1], &indexes[index],
-                                 sizeof(indexes[0]) * (++count - index));
-        UpdateIndex(index, k, offset);
+        assert(index <= static_cast<int>(count));
+        assert(CanInsertKey(k));
+        if (!HasPrefix(k)) {
+            Cells cells = AllCells();
+            cells.emplace(cells.begin() + index, k, offset);
+            Rebuild(cells, 0, cells.size());
+            return;
+        }
+        PutCell(count++ + 1, index, k.substr(prefix), offset);
+    }
+
+    // Store a cell whose key is already stripped of prefix.
+    void PutCell(size_t n, int index, std::string_view k, off_t offset) {
+        // `k` may point into this page, which is moved by compaction.
+        char key[kMaxKeySize];
+        if (!k.empty()) std::memcpy(key, k.data(), k.size());
+        char* cell = InsertCell(n, index, CellSpace(k.size()) - sizeof(Slot),
+                                                        std::string_view(key, k.size()));
+        uint16_t key_size = static_cast<uint16_t>(k.size());
+        std::memcpy(cell, &offset, sizeof(offset));
+        std::memcpy(cell + sizeof(off_t), &key_size, sizeof(key_size));
+        std::memcpy(cell + kHeaderSize, key, k.size());
+    }
+
+    // Remove the last child, the key before it is dropped too.
+    void DeleteLastIndex() {
+        assert(count > 0);
+        off_t offset = Child(count - 1);
+        RemoveCell(count + 1, count);
+        RemoveCell(count, count - 1);
+        PutCell(count - 1, count - 1, std::string_view(), offset);
+        --count;
     }
 
-    void MergeLeftSibling(IndexNode* sibling) {
-        std::memmove(&indexes[sibling->count + 1], &indexes[0],
-                                 sizeof(indexes[0]) * (count + 1));
-        std::memcpy(&indexes[0], &sibling->indexes[0],
-                                sizeof(indexes[0]) * (sibling->count + 1));
-        count += (sibling->count + 1);
+    // Cells of `left`, then cells of `right` with key `k` between them.
+    static Cells Concat(const IndexNode* left, std::string_view k,
+                                            const IndexNode* right) {
+        Cells cells = left->AllCells();
+        cells.back().first = k;
+        Cells right_cells = right->AllCells();
+        cells.insert(cells.end(), right_cells.begin(), right_cells.end());
+        return cells;
     }
 
-    void MergeRightSibling(IndexNode* sibling) {
-        std::memcpy(&indexes[count], &sibling->indexes[0],
-                                sizeof(indexes[0]) * (sibling->count + 1));
-        count += sibling->count;
+    bool CanLend(int index) const {
+        return UsedSpace(count + 1) - CellSize(index) - sizeof(Slot) >=
+                     Capacity() / 4;
     }
 
-    Index indexes[kOrder + 1];
+    bool Underflow() const { return UsedSpace(count + 1) < Capacity() / 4; }
 };
 
+// Cell of leaf node: | key size | flags | value size | key without prefix |
+// value |
+// If the value is stored in overflow pages, the offset of the first page
+// takes place of the value. A posting list is flagged as such. Records passed in and out of a leaf node have
+// the same layout with the full key.
 struct BPlusTree::LeafNode : BPlusTree::Node {
-    LeafNode() = default;
+    explicit LeafNode(size_t page_size) : Node(page_size) {}
     ~LeafNode() = default;
 
-    const char* FirstKey() const {
-        assert(count > 0);
-        return records[0].key;
+    typedef std::vector<std::string> Records;
+
+    static constexpr uint16_t kOverflow = 1;
+    static constexpr uint16_t kPostings = 2;
+    static constexpr size_t kHeaderSize =
+            sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint32_t);
+
+    static std::string_view RecordKey(std::string_view record) {
+        uint16_t key_size;
+        std::memcpy(&key_size, record.data(), sizeof(key_size));
+        return record.substr(kHeaderSize, key_size);
+    }
+
+    // Bytes needed to store records[begin, end) in one node.
+    static size_t PackedSize(const Records& records, size_t begin, size_t end) {
+        if (begin == end) return 0;
+        size_t p = CommonPrefix(RecordKey(records[begin]),
+                                                        RecordKey(records[end - 1]));
+        size_t size = p;
+        for (size_t i = begin; i < end; ++i) {
+            size += records[i].size() - p + sizeof(Slot);
+        }
+        return size;
     }
 
-    const char* LastKey() const {
+    std::string FirstKey() const {
         assert(count > 0);
-        return records[count - 1].key;
+        return Key(0);
     }
 
-    const char* Key(int index) const {
+    std::string LastKey() const {
         assert(count > 0);
+        return Key(count - 1);
+    }
+
+    std::string_view Suffix(int index) const {
         assert(index >= 0);
-        return records[index].key;
+        assert(index < static_cast<int>(count));
+        const char* cell = Cell(index);
+        uint16_t key_size;
+        std::memcpy(&key_size, cell, sizeof(key_size));
+        return std::string_view(cell + kHeaderSize, key_size);
     }
 
-    const char* FirstValue() const {
-        assert(count > 0);
-        return records[0].value;
+    std::string Key(int index) const {
+        std::string key(Prefix());
+        key.append(Suffix(index));
+        return key;
     }
 
-    const char* LastValue() const {
-        assert(count > 0);
-        return records[count - 1].value;
+    bool KeyEquals(int index, std::string_view k) const {
+        return HasPrefix(k) && k.substr(prefix) == Suffix(index);
     }
 
-    const char* Value(int index) const {
-        assert(count > 0);
-        return records[index].value;
+    uint16_t Flags(int index) const {
+        uint16_t flags;
+        std::memcpy(&flags, Cell(index) + sizeof(uint16_t), sizeof(flags));
+        return flags;
     }
 
-    void UpdateValue(int index, const char* v) {
-        assert(index >= 0);
-        records[index].UpdateValue(v);
+    bool IsOverflow(int index) const { return Flags(index) & kOverflow; }
+    bool IsPostings(int index) const { return Flags(index) & kPostings; }
+
+    size_t ValueSize(int index) const {
+        uint32_t value_size;
+        std::memcpy(&value_size, Cell(index) + 2 * sizeof(uint16_t),
+                                sizeof(value_size));
+        return value_size;
     }
 
-    void UpdateKey(int index, const char* k) {
-        assert(index >= 0);
-        records[index].UpdateKey(k);
+    void SetValueSize(int index, size_t size) {
+        uint32_t value_size = static_cast<uint32_t>(size);
+        std::memcpy(Cell(index) + 2 * sizeof(uint16_t), &value_size,
+                                sizeof(value_size));
     }
 
-    void UpdateKV(int index, const char* k, const char* v) {
-        assert(index >= 0);
-        records[index].UpdateKV(k, v);
+    // Inline value, or the encoded offset of the first overflow page.
+    std::string_view Value(int index) const {
+        std::string_view suffix = Suffix(index);
+        const char* value = suffix.data() + suffix.size();
+        return std::string_view(value, Cell(index) + CellSize(index) - value);
+    }
+
+    // Whether slots and cells lie inside a page of `size` bytes.
+    bool Intact(size_t size) const {
+        if (!Node::Intact(count, size)) return false;
+        for (size_t i = 0; i < count; ++i) {
+            if (CellSize(i) < kHeaderSize ||
+                    kHeaderSize + Suffix(i).size() > CellSize(i) ||
+                    (IsOverflow(i) && Value(i).size() != sizeof(off_t))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    off_t OverflowOffset(int index) const {
+        assert(IsOverflow(index));
+        off_t offset;
+        std::memcpy(&offset, Value(index).data(), sizeof(offset));
+        return offset;
+    }
+
+    std::string Record(int index) const {
+        return MakeRecord(Key(index), Value(index), Flags(index),
+                                            ValueSize(index));
+    }
+
+    Records AllRecords() const {
+        Records records;
+        records.reserve(count + 1);
+        for (size_t i = 0; i < count; ++i) records.push_back(Record(i));
+        return records;
+    }
+
+    // Refill node with records[begin, end).
+    void Rebuild(const Records& records, size_t begin, size_t end) {
+        assert(PackedSize(records, begin, end) <= Capacity());
+        if (begin == end) {
+            Reset();
+            return;
+        }
+        size_t p = CommonPrefix(RecordKey(records[begin]),
+                                                        RecordKey(records[end - 1]));
+        Reset(RecordKey(records[begin]).substr(0, p));
+        for (size_t i = begin; i < end; ++i) {
+            PutRecord(i - begin, i - begin, records[i]);
+        }
+        count = end - begin;
+    }
+
+    bool CanInsertRecord(std::string_view record) const {
+        // An empty node drops its prefix and takes any record.
+        if (count == 0) return true;
+        std::string_view k = RecordKey(record);
+        if (HasPrefix(k)) return Fits(count, record.size() - prefix);
+        // Prefix gets shorter and every stored key grows by the difference.
+        size_t p = CommonPrefix(k, Prefix());
+        return UsedSpace(count) - prefix + p + count * (prefix - p) +
+                             record.size() - p + sizeof(Slot) <=
+                     Capacity();
     }
 
-    void InsertKVAtIndex(int index, const char* k, const char* v) {
+    void InsertRecordAtIndex(int index, std::string_view record) {
         assert(index >= 0);
-        assert(index < kOrder);
-        std::memmove(&records[index + 1], &records[index],
-                                 sizeof(records[0]) * (count++ - index));
-        UpdateKV(index, k, v);
+        assert(index <= static_cast<int>(count));
+        assert(CanInsertRecord(record));
+        if (count == 0) Reset();
+        if (!HasPrefix(RecordKey(record))) {
+            Records records = AllRecords();
+            records.emplace(records.begin() + index, record);
+            Rebuild(records, 0, records.size());
+            return;
+        }
+        PutRecord(count++, index, record);
+    }
+
+    void AppendRecord(std::string_view record) {
+        InsertRecordAtIndex(count, record);
     }
 
     void DeleteKVAtIndex(int index) {
         assert(index >= 0);
-        assert(index < kOrder);
-        std::memmove(&records[index], &records[index + 1],
-                                 sizeof(records[0]) * (--count - index));
+        assert(index < static_cast<int>(count));
+        RemoveCell(count--, index);
+    }
+
+    // Store record as slot `index` of `n` slots, its key must have prefix.
+    void PutRecord(size_t n, int index, std::string_view record) {
+        assert(HasPrefix(RecordKey(record)));
+        size_t key_size = RecordKey(record).size() - prefix;
+        char* cell = InsertCell(n, index, record.size() - prefix,
+                                                        RecordKey(record).substr(prefix));
+        uint16_t size = static_cast<uint16_t>(key_size);
+        std::memcpy(cell, &size, sizeof(size));
+        std::memcpy(cell + sizeof(uint16_t), record.data() + sizeof(uint16_t),
+                                kHeaderSize - sizeof(uint16_t));
+        std::memcpy(cell + kHeaderSize, record.data() + kHeaderSize + prefix,
+                                record.size() - kHeaderSize - prefix);
+    }
+
+    // Records of `left` followed by records of `right`.
+    static Records Concat(const LeafNode* left, const LeafNode* right) {
+        Records records = left->AllRecords();
+        Records right_records = right->AllRecords();
+        records.insert(records.end(), right_records.begin(), right_records.end());
+        return records;
+    }
+
+    bool CanLend(int index) const {
+        return UsedSpace(count) - CellSize(index) - sizeof(Slot) >=
+                     Capacity() / 4;
+    }
+
+    bool Underflow() const { return UsedSpace(count) < Capacity() / 4; }
+
+    static std::string MakeRecord(std::string_view k, std::string_view v,
+                                                                uint16_t flags, size_t value_size) {
+        std::string record(kHeaderSize + k.size() + v.size(), '\0');
+        uint16_t key_size = static_cast<uint16_t>(k.size());
+        uint32_t size = static_cast<uint32_t>(value_size);
+        std::memcpy(&record[0], &key_size, sizeof(key_size));
+        std::memcpy(&record[sizeof(uint16_t)], &flags, sizeof(flags));
+        std::memcpy(&record[2 * sizeof(uint16_t)], &size, sizeof(size));
+        std::memcpy(&record[kHeaderSize], k.data(), k.size());
+        std::memcpy(&record[kHeaderSize + k.size()], v.data(), v.size());
+        return record;
+    }
+};
+
+// Page of a value too long to be stored inline, chained by `right`.
+// `count` is the number of bytes of value stored in this page. `left` of
+// the first page is the last one, or 0 in files which predate it.
+struct BPlusTree::OverflowNode : BPlusTree::Node {
+    explicit OverflowNode(size_t page_size) : Node(page_size) {}
+    ~OverflowNode() = default;
+
+    char* Data() { return reinterpret_cast<char*>(this + 1); }
+    const char* Data() const { return reinterpret_cast<const char*>(this + 1); }
+};
+
+// Page of a blocked Bloom filter. All bits of a key fall into one block of a
+// cache line, so a probe reads a single line. Pages of a filter follow each
+// other in the file, block `b` is in page b / Blocks().
+struct BPlusTree::FilterNode : BPlusTree::Node {
+    static constexpr size_t kBlockBits = 512;
+
+    explicit FilterNode(size_t page_size) : Node(page_size) {
+        std::memset(Block(0), 0, Blocks(page_size) * kBlockBits / 8);
+    }
+    ~FilterNode() = default;
+
+    static size_t Blocks(size_t page_size) {
+        return (page_size - sizeof(Node)) / (kBlockBits / 8);
+    }
+    // Bits set per key, about ln 2 times the bits per key.
+    static size_t Probes(size_t bits_per_key) {
+        return std::clamp<size_t>(bits_per_key * 69 / 100, 1, 16);
+    }
+    static uint64_t Hash(std::string_view key) {
+        // FNV-1a mixed by the finalizer of MurmurHash3, FNV alone leaves the
+        // high bits poor.
+        uint64_t h = Checksum(key.data(), key.size());
+        h = (h ^ (h >> 33)) * 0xff51afd7ed558ccdull;
+        h = (h ^ (h >> 33)) * 0xc4ceb9fe1a85ec53ull;
+        return h ^ (h >> 33);
+    }
+    // Block of `hash` out of `blocks`, the high half picks it.
+    static size_t BlockOf(uint64_t hash, size_t blocks) {
+        return static_cast<size_t>(((hash >> 32) * blocks) >> 32);
     }
 
-    void MergeLeftSibling(LeafNode* sibling) {
-        std::memmove(&records[sibling->count], &records[0],
-                                 sizeof(records[0]) * count);
-        std::memcpy(&records[0], &sibling->records[0],
-                                sizeof(records[0]) * sibling->count);
-        count += sibling->count;
+    uint64_t* Block(size_t i) {
+        return reinterpret_cast<uint64_t*>(this + 1) + i * (kBlockBits / 64);
+    }
+    const uint64_t* Block(size_t i) const {
+        return reinterpret_cast<const uint64_t*>(this + 1) + i * (kBlockBits / 64);
     }
 
-    void MergeRightSibling(LeafNode* sibling) {
-        std::memcpy(&records[count], &sibling->records[0],
-                                sizeof(records[0]) * sibling->count);
-        count += sibling->count;
+    // The low half of `hash` picks `probes` bits by double hashing.
+    static void Add(uint64_t* block, uint64_t hash, size_t probes) {
+        uint32_t h = static_cast<uint32_t>(hash);
+        const uint32_t delta = (h >> 17) | (h << 15);
+        for (size_t i = 0; i < probes; ++i, h += delta) {
+            block[h % kBlockBits / 64] |= 1ull << (h % 64);
+        }
+    }
+    static bool MayContain(const uint64_t* block, uint64_t hash, size_t probes) {
+        uint32_t h = static_cast<uint32_t>(hash);
+        const uint32_t delta = (h >> 17) | (h << 15);
+        for (size_t i = 0; i < probes; ++i, h += delta) {
+            if ((block[h % kBlockBits / 64] & (1ull << (h % 64))) == 0) return false;
+        }
+        return true;
     }
+};
 
-    BPlusTree::Record records[kOrder];
+// Page table of a commit in shadow mode, held by a snapshot. Table pages
+// are never written again once committed.
+struct BPlusTree::View {
+    uint64_t generation;
+    size_t pages;
+    std::vector<off_t> table_pages;
 };
 
+// The file is mapped as regions of kRegionSize bytes which are never
+// moved or unmapped while the tree is open, so a block is found by pointer
+// arithmetic and pointers to it stay valid. Residency is tracked per extent
+// of kExtentSize bytes with a CLOCK hand, extents beyond the budget are
+// handed back to the OS, the page cache keeps their contents.
+//
+// Every page has a version in a striped table. A writer latches a page by
+// making its version odd, readers copy pages optimistically and retry when
+// the version moved meanwhile. Only one writer runs at a time.
+//
+// In shadow mode offsets of the tree are logical. A page table maps them to
+// pages of the file, and a batch writes the pages it changed to free pages
+// of the file together with the changed parts of the table. Two
+// checksummed superblocks at kMetaOffset take turns to point at the newest
+// table, writing one of them commits the batch.
 class BPlusTree::BlockCache {
-    struct Node;
+    struct Region;
+    struct Chunk;
+    struct Superblock;
 
  public:
-    BlockCache() : head_(new Node()), size_(0) {
-        head_->next = head_;
-        head_->prev = head_;
+    BlockCache(int fd, bool shadow, size_t page_size, size_t cache_size)
+            : fd_(fd),
+                file_size_(0),
+                page_size_(page_size),
+                resident_(0),
+                budget_(std::max<size_t>(cache_size / kExtentSize, 2)),
+                hand_(0),
+                versions_(),
+                batch_(false),
+                shadow_(false),
+                zeros_(),
+                generation_(0),
+                pages_(0),
+                end_(0),
+                truncate_(-1) {
+#ifdef _WIN32
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(FileHandle(), &fileSize)) Exit("GetFileSizeEx");
+        file_size_ = fileSize.QuadPart;
+#else
+        struct stat st;
+        if (fstat(fd_, &st) != 0) Exit("fstat");
+        file_size_ = st.st_size;
+#endif
+        for (auto& region : regions_) region.store(nullptr);
+        for (auto& chunk : table_) chunk.store(nullptr);
+        // The mode and page size are up to the file once it has been
+        // created.
+        if (file_size_.load() == 0) {
+            if (shadow) Format();
+            return;
+        }
+        LoadTable();
+        if (!shadow_ && file_size_.load() >= static_cast<off_t>(sizeof(Meta))) {
+            size_t size = reinterpret_cast<const Meta*>(Physical(kMetaOffset))->page_size;
+            if (size != 0) page_size_ = size;
+        }
     }
 
     ~BlockCache() {
-        for (auto it = offset2node_.begin(); it != offset2node_.end(); it++) {
-            Node* node = it->second;
+        for (auto& r : regions_) {
+            Region* region = r.load();
+            if (region == nullptr) continue;
 #ifdef _WIN32
-            UnmapViewOfFile(node->block);
-            CloseHandle(node->hMapFile);
+            UnmapViewOfFile(region->addr);
+            CloseHandle(region->hMapFile);
 #else
-            off_t page_offset = node->offset & ~(sysconf(_SC_PAGE_SIZE) - 1);
-            char* start = reinterpret_cast<char*>(node->block);
-            void* addr = static_cast<void*>(&start[page_offset - node->offset]);
-            if (munmap(addr, node->size + node->offset - page_offset) != 0) {
-                Exit("munmap");
-            }
+            if (munmap(region->addr, kRegionSize) != 0) Exit("munmap");
 #endif
-            delete node;
+            delete region;
         }
-        delete head_;
+        for (auto& chunk : table_) delete chunk.load();
     }
 
-    void DeleteNode(Node* node) {
-        if (node->next == node->prev && nullptr == node->next) return;
-        node->prev->next = node->next;
-        node->next->prev = node->prev;
-        node->next = node->prev = nullptr;
-        size_ -= node->size;
-    }
+    bool Shadow() const { return shadow_; }
+    size_t PageSize() const { return page_size_; }
 
-    void InsertHead(Node* node) {
-        node->next = head_->next;
-        node->prev = head_;
-        head_->next->prev = node;
-        head_->next = node;
-        size_ += node->size;
+    // Block for a writer, the file grows to cover it. Unless `write` the
+    // writer only reads it.
+    template <typename T>
+    T* get(off_t offset, bool write = true) {
+        static_assert(sizeof(T) <= kMinPageSize, "Block must fit in one page.");
+        if (!shadow_ && offset + static_cast<off_t>(page_size_) > file_size_.load()) {
+            Grow(offset + page_size_);
+        }
+        // Nodes are checked when first read and sealed once written.
+        constexpr bool node = std::is_base_of<Node, T>::value;
+        char* block = Block(offset);
+        if (!batch_) {
+            if (node && written_.count(offset) == 0) {
+                Check(offset, true);
+                if (write) written_.insert(offset);
+            }
+            return reinterpret_cast<T*>(block);
+        }
+        auto copy = copies_.find(offset);
+        if (copy != copies_.end()) return reinterpret_cast<T*>(copy->second.get());
+        if (node) Check(offset, true);
+        if (!write) return reinterpret_cast<T*>(block);
+        char* page = new char[page_size_];
+        std::memcpy(page, block, page_size_);
+        copies_[offset].reset(page);
+        return reinterpret_cast<T*>(page);
     }
 
-    Node* DeleteTail() {
-        if (size_ == 0) {
-            assert(head_->next == head_);
-            assert(head_->prev == head_);
-            return nullptr;
+    // Until EndBatch() the writer works on private copies of pages, the
+    // mapping and so the readers do not see any of it.
+    void BeginBatch() { batch_ = true; }
+
+    // Pages changed by the batch, ordered by offset. Nodes among them are
+    // sealed.
+    std::vector<std::pair<off_t, const char*>> DirtyPages() {
+        std::vector<std::pair<off_t, const char*>> pages;
+        for (auto& copy : copies_) {
+            if (std::memcmp(copy.second.get(), Block(copy.first), page_size_) != 0) {
+                if (copy.first != kMetaOffset) Seal(copy.second.get());
+                pages.emplace_back(copy.first, copy.second.get());
+            }
         }
-        Node* tail = head_->prev;
-        DeleteNode(tail);
-        return tail;
+        return pages;
     }
 
-    template <typename T>
-    void upsert(T* block) {
-        while (size_ > kMaxCacheSize) Kick();
-
-        if (offset2node_.find(block->offset) == offset2node_.end()) {
-            Node* node = new Node(block, block->offset, sizeof(T));
-            offset2node_.emplace(block->offset, node);
-            InsertHead(node);
+    // Publish the pages changed by the batch, they stay latched until
+    // UnlatchAll(). In shadow mode this commits the batch.
+    void EndBatch() {
+        if (!batch_) return;
+        batch_ = false;
+        if (shadow_) {
+            Commit(DirtyPages());
         } else {
-            Node* node = offset2node_[block->offset];
-            if (--node->ref == 0) InsertHead(node);
+            for (auto& page : DirtyPages()) {
+                Latch(page.first);
+                std::memcpy(Block(page.first), page.second, page_size_);
+            }
         }
+        copies_.clear();
     }
 
-    template <typename T>
-    T* get(int fd, off_t offset) {
-        if (offset2node_.find(offset) == offset2node_.end()) {
-            constexpr int size = sizeof(T);
+    // Drop the pages changed by the batch, nobody ever sees them.
+    void AbortBatch() {
+        batch_ = false;
+        copies_.clear();
+        truncate_ = -1;
+    }
+
+    // Write changed pages of the mapping through to the file.
+    void Sync() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < kMaxRegions; ++i) {
+            Region* region = regions_[i].load();
+            if (region == nullptr) continue;
 #ifdef _WIN32
-            HANDLE hFile = (HANDLE)_get_osfhandle(fd);
-            if (hFile == INVALID_HANDLE_VALUE) Exit("_get_osfhandle");
-
-            LARGE_INTEGER fileSize;
-            if (!GetFileSizeEx(hFile, &fileSize)) Exit("GetFileSizeEx");
-            if (fileSize.QuadPart < offset + size) {
-                LARGE_INTEGER newSize;
-                newSize.QuadPart = offset + size;
-                if (!SetFilePointerEx(hFile, newSize, NULL, FILE_BEGIN) || 
-                        !SetEndOfFile(hFile)) {
-                    Exit("SetFilePointerEx/SetEndOfFile");
-                }
+            if (!FlushViewOfFile(region->addr, 0)) Exit("FlushViewOfFile");
+#else
+            off_t start = static_cast<off_t>(i * kRegionSize);
+            off_t size = std::min(file_size_.load() - start,
+                                                        static_cast<off_t>(kRegionSize));
+            if (size > 0 && msync(region->addr, AlignUp(size), MS_SYNC) != 0) {
+                Exit("msync");
             }
+#endif
+        }
+#ifdef _WIN32
+        if (!FlushFileBuffers(FileHandle())) Exit("FlushFileBuffers");
+#endif
+    }
 
-            HANDLE hMapFile = CreateFileMapping(
-                    hFile, NULL, PAGE_READWRITE, 0, 0, NULL);
-            if (hMapFile == NULL) Exit("CreateFileMapping");
+    // Block for a reader. Beyond end of file it reads as zeros. With `pin`
+    // its extent stays resident, meant for the upper levels of the tree.
+    const char* Read(off_t offset, bool pin = false) {
+        const char* block = Block(offset, pin);
+        Check(offset, false);
+        return block;
+    }
 
-            void* mapAddr = MapViewOfFile(
-                    hMapFile, FILE_MAP_ALL_ACCESS, 0, offset, size);
-            if (mapAddr == NULL) {
-                CloseHandle(hMapFile);
-                Exit("MapViewOfFile");
-            }
+    // Block of a snapshot, looked up in the table it was taken with.
+    const char* Read(off_t offset, const View& view) {
+        off_t physical = Translate(offset, view);
+        if (physical == 0) return zeros_;
+        const char* block = Physical(physical);
+        Check(offset, physical);
+        return block;
+    }
 
-            T* block = static_cast<T*>(mapAddr);
-            Node* node = new Node(block, offset, size);
-            node->hMapFile = hMapFile;
-#else
-            struct stat st;
-            if (fstat(fd, &st) != 0) Exit("fstat");
-            if (st.st_size < offset + size && ftruncate(fd, offset + size) != 0) {
-                Exit("ftruncate");
+    // Ask the OS to read pages at `offsets` in the background, leaving out
+    // those of resident extents. Pages which follow each other in the file
+    // go in one request. Residency is left to the reads which follow.
+    void Prefetch(const std::vector<off_t>& offsets, const View* view) {
+        std::vector<off_t> pages;
+        for (off_t offset : offsets) {
+            off_t physical = view != nullptr ? Translate(offset, *view)
+                                             : shadow_ ? Translate(offset) : offset;
+            if (physical == 0 ||
+                    physical + static_cast<off_t>(page_size_) > file_size_.load()) {
+                continue;
+            }
+            size_t index = physical / kRegionSize;
+            Region* region = regions_[index].load(std::memory_order_acquire);
+            if (region == nullptr) region = MapRegion(index);
+            uint8_t s = region->extents[physical % kRegionSize / kExtentSize].load(
+                    std::memory_order_relaxed);
+            if (s == kAbsent || s == kGhost) pages.push_back(physical);
+        }
+        std::sort(pages.begin(), pages.end());
+        for (size_t i = 0, j; i < pages.size(); i = j) {
+            // Runs do not cross regions, which are mapped apart.
+            for (j = i + 1; j < pages.size() &&
+                                            pages[j] == pages[j - 1] + static_cast<off_t>(page_size_) &&
+                                            pages[j] % kRegionSize != 0;
+                     ++j) {
             }
-            // Align offset to page size.
-            off_t page_offset = offset & ~(sysconf(_SC_PAGE_SIZE) - 1);
-            void* addr = mmap(nullptr, size + offset - page_offset,
-                                                PROT_READ | PROT_WRITE, MAP_SHARED, fd, page_offset);
-            if (MAP_FAILED == addr) Exit("mmap");
-            char* start = static_cast<char*>(addr);
-            T* block = reinterpret_cast<T*>(&start[offset - page_offset]);
-            Node* node = new Node(block, offset, size);
+            char* addr = regions_[pages[i] / kRegionSize].load()->addr +
+                                     pages[i] % kRegionSize;
+            size_t size = (j - i) * page_size_;
+            // Only a hint, failing is harmless.
+#ifdef _WIN32
+            WIN32_MEMORY_RANGE_ENTRY range{addr, size};
+            PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+            madvise(addr, size, MADV_WILLNEED);
 #endif
-            offset2node_.emplace(offset, node);
-            return block;
         }
+    }
+
+    // Block as it is, for the verifier which checks it on its own.
+    const char* Peek(off_t offset) { return Block(offset); }
 
-        Node* node = offset2node_[offset];
-        ++node->ref;
-        DeleteNode(node);
-        return static_cast<T*>(node->block);
+    // Hold the table of the last commit, pages freed from now on are kept
+    // until CloseView().
+    View* OpenView() {
+        std::lock_guard<std::mutex> lock(views_mutex_);
+        views_.insert(generation_);
+        return new View{generation_, pages_, table_pages_};
     }
 
- private:
-    void Kick() {
-        Node* tail = DeleteTail();
-        if (nullptr == tail) return;
+    void CloseView(View* view) {
+        std::lock_guard<std::mutex> lock(views_mutex_);
+        views_.erase(views_.find(view->generation));
+        delete view;
+    }
 
-        assert(tail != head_);
+    // Give up the file beyond `end`, only the writer calls this. In shadow
+    // mode the logical pages are dropped when the batch commits.
+    void Truncate(off_t end) {
+        if (shadow_) {
+            truncate_ = end;
+            copies_.erase(copies_.lower_bound(end), copies_.end());
+            return;
+        }
+        TruncateFile(end);
+    }
 
-#ifdef _WIN32
-        UnmapViewOfFile(tail->block);
-        CloseHandle(tail->hMapFile);
-#else
-        off_t page_offset = tail->offset & ~(sysconf(_SC_PAGE_SIZE) - 1);
-        char* start = reinterpret_cast<char*>(tail->block);
-        void* addr = static_cast<void*>(&start[page_offset - tail->offset]);
-        if (munmap(addr, tail->size + tail->offset - page_offset) != 0) {
-            Exit("munmap");
+    // Version of page at `offset` once no writer holds it.
+    uint64_t StableVersion(off_t offset) const {
+        const std::atomic<uint64_t>& version = Version(offset);
+        while (true) {
+            uint64_t v = version.load(std::memory_order_acquire);
+            if ((v & 1) == 0) return v;
+            std::this_thread::yield();
         }
-#endif
-        offset2node_.erase(tail->offset);
-        delete tail;
-    }
-
-    struct Node {
-        Node()
-                : block(nullptr),
-                    offset(0),
-                    size(0),
-                    ref(0),
-                    prev(nullptr),
-                    next(nullptr) {}
-#ifdef _WIN32
-                    , hMapFile(NULL)
-#endif
+    }
 
-        Node(void* block_, off_t offset_, size_t size_)
-                : block(block_),
-                    offset(offset_),
-                    size(size_),
-                    ref(1),
-                    prev(nullptr),
-                    next(nullptr) {}
-#ifdef _WIN32
-                    , hMapFile(NULL)
-#endif
+    // Whether page at `offset` is unchanged since `version` was read.
+    bool Validate(off_t offset, uint64_t version) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return Version(offset).load(std::memory_order_relaxed) == version;
+    }
 
-        void* block;
-        off_t offset;
-        size_t size;
-        size_t ref;
-        Node* prev;
-        Node* next;
-#ifdef _WIN32
-        HANDLE hMapFile;
-#endif
-    };
+    // Latch page at `offset` for the running writer until UnlatchAll().
+    void Latch(off_t offset) {
+        // Pages of a batch are latched when it ends.
+        if (batch_) return;
+        std::atomic<uint64_t>& version = Version(offset);
+        uint64_t v = version.load(std::memory_order_relaxed);
+        if (v & 1) return;
+        version.store(v + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        latched_.push_back(&version);
+    }
 
-    Node* head_;
-    size_t size_;
-    std::unordered_map<off_t, Node*> offset2node_;
-};
+    void UnlatchAll() {
+        // Nodes written in place are sealed before readers may copy them.
+        for (off_t offset : written_) {
+            // Pages may have been cut off meanwhile.
+            if (offset < file_size_.load()) Seal(Block(offset));
+        }
+        written_.clear();
+        for (std::atomic<uint64_t>* version : latched_) {
+            version->store(version->load(std::memory_order_relaxed) + 1,
+                                         std::memory_order_release);
+        }
+        latched_.clear();
+    }
+
+ private:
+    // Extent states. A resident extent is cold until it is touched again
+    // after it was released, then it is hot. Cold extents leave in FIFO
+    // order, hot ones by CLOCK.
+    static constexpr uint8_t kAbsent = 0;
+    static constexpr uint8_t kCold = 1;
+    static constexpr uint8_t kHot = 2;
+    static constexpr uint8_t kHotReferenced = 3;
+    static constexpr uint8_t kGhost = 4;    // absent, released while cold
+    static constexpr uint8_t kPinned = 5;   // holds upper levels, never released
+
+    static constexpr size_t kMaxRegions = 1 << 12;
+    static constexpr size_t kExtents = kRegionSize / kExtentSize;    // per region
+    static constexpr size_t kLatchStripes = 1 << 14;
+    static constexpr uint64_t kShadowMagic = 0x574f444148535042;
+
+    std::atomic<uint64_t>& Version(off_t offset) {
+        return versions_[static_cast<uint64_t>(offset) / page_size_ % kLatchStripes];
+    }
+    const std::atomic<uint64_t>& Version(off_t offset) const {
+        return versions_[static_cast<uint64_t>(offset) / page_size_ % kLatchStripes];
+    }
 
-BPlusTree::BPlusTree(const char* path)
-        : block_cache_(new BlockCache()) {
+    // Cut the file at `end`.
+    void TruncateFile(off_t end) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (size_t i = 0; i < kMaxRegions; ++i) {
+            Region* region = regions_[i].load();
+            if (region == nullptr) continue;
+            for (size_t j = 0; j < kExtents; ++j) {
+                off_t offset = static_cast<off_t>(i * kRegionSize + j * kExtentSize);
+                if (offset + static_cast<off_t>(kExtentSize) > end) {
+                    Release(region, j, region->extents[j].exchange(kAbsent));
+                }
+            }
+        }
 #ifdef _WIN32
-    fd_ = _open(path, _O_CREAT | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+        HANDLE hFile = FileHandle();
+        LARGE_INTEGER newSize;
+        newSize.QuadPart = end;
+        if (!SetFilePointerEx(hFile, newSize, NULL, FILE_BEGIN) ||
+                !SetEndOfFile(hFile)) {
+            Exit("SetFilePointerEx/SetEndOfFile");
+        }
+#else
+        // Pages past the new end are swapped for anonymous ones first, a
+        // reader holding a stale offset then sees zeros instead of SIGBUS.
+        Remap(AlignUp(end), file_size_.load(), false);
+        if (ftruncate(fd_, end) != 0) Exit("ftruncate");
+#endif
+        file_size_.store(end);
+    }
+
+    // Check node at logical `offset` the first time it is read since its
+    // extent came in. The writer sees pages `stable`, a reader leaves pages
+    // the writer holds to later reads.
+    void Check(off_t offset, bool stable) {
+        if (offset == kMetaOffset) return;
+        uint64_t bit;
+        std::atomic<uint64_t>* checked =
+                CheckedBit(shadow_ ? Translate(offset) : offset, bit);
+        if (checked == nullptr || (checked->load(std::memory_order_relaxed) & bit)) {
+            return;
+        }
+        uint64_t version = Version(offset).load(std::memory_order_acquire);
+        if (!stable && (version & 1)) return;
+        // In shadow mode the page moves on commit, so look it up again after
+        // the version was taken.
+        off_t physical = shadow_ ? Translate(offset) : offset;
+        checked = CheckedBit(physical, bit);
+        if (checked == nullptr) return;
+        bool valid = Valid(physical);
+        if (!stable && !Validate(offset, version)) return;
+        if (!valid) Corrupted(offset);
+        checked->fetch_or(bit, std::memory_order_relaxed);
+    }
+
+    // Same for a page of a snapshot at `physical`, which does not change.
+    void Check(off_t offset, off_t physical) {
+        if (offset == kMetaOffset) return;
+        uint64_t bit;
+        std::atomic<uint64_t>* checked = CheckedBit(physical, bit);
+        if (checked == nullptr || (checked->load(std::memory_order_relaxed) & bit)) {
+            return;
+        }
+        if (!Valid(physical)) Corrupted(offset);
+        checked->fetch_or(bit, std::memory_order_relaxed);
+    }
+
+    // Word and `bit` marking page at `physical` as checked, null when the
+    // page is not in a mapped region.
+    std::atomic<uint64_t>* CheckedBit(off_t physical, uint64_t& bit) {
+        if (physical == 0) return nullptr;
+        Region* region = regions_[physical / kRegionSize].load(std::memory_order_acquire);
+        if (region == nullptr) return nullptr;
+        size_t page = physical % kRegionSize / kMinPageSize;
+        bit = uint64_t(1) << page % 64;
+        return &region->checked[page / 64];
+    }
+
+    // Whether node at `physical` matches its checksum, or was never sealed.
+    bool Valid(off_t physical) {
+        auto* node = reinterpret_cast<const Node*>(
+                regions_[physical / kRegionSize].load()->addr + physical % kRegionSize);
+        uint32_t checksum = node->checksum;
+        return checksum == 0 || checksum == node->Sum(page_size_);
+    }
+
+    static void Corrupted(off_t offset) {
+        throw std::runtime_error("page at " + std::to_string(offset) +
+                                                         " is corrupted");
+    }
+
+    void Seal(char* block) {
+        auto* node = reinterpret_cast<Node*>(block);
+        uint32_t checksum = node->Sum(page_size_);
+        // Left alone when unchanged, so the page does not turn dirty.
+        if (node->checksum != checksum) node->checksum = checksum;
+    }
+
+    // Page at logical `offset`, pages not in the table read as zeros.
+    char* Block(off_t offset, bool pin = false) {
+        if (!shadow_) return Physical(offset, pin);
+        off_t physical = Translate(offset);
+        return physical == 0 ? zeros_ : Physical(physical, pin);
+    }
+
+    off_t Translate(off_t offset) const {
+        Chunk* chunk = table_[offset / kRegionSize].load(std::memory_order_acquire);
+        if (chunk == nullptr) return 0;
+        return chunk->entries[offset % kRegionSize / page_size_].load(
+                std::memory_order_acquire);
+    }
+
+    // Page of the file holding logical `offset` in snapshot `view`, or 0.
+    off_t Translate(off_t offset, const View& view) {
+        size_t page = offset / page_size_;
+        if (page >= view.pages) return 0;
+        off_t of_table = view.table_pages[page / Entries()];
+        if (of_table == 0) return 0;
+        return reinterpret_cast<const off_t*>(Physical(of_table))[page % Entries()];
+    }
+
+    void SetTranslation(off_t offset, off_t physical) {
+        std::atomic<Chunk*>& chunk = table_[offset / kRegionSize];
+        if (chunk.load() == nullptr) chunk.store(new Chunk(), std::memory_order_release);
+        chunk.load()->entries[offset % kRegionSize / page_size_].store(
+                physical, std::memory_order_release);
+    }
+
+    char* Physical(off_t offset, bool pin = false) {
+        size_t index = offset / kRegionSize;
+        assert(index < kMaxRegions);
+        Region* region = regions_[index].load(std::memory_order_acquire);
+        if (region == nullptr) region = MapRegion(index);
+        Touch(region, offset / kExtentSize, pin);
+        return region->addr + offset % kRegionSize;
+    }
+
+    // Entries of a page of the page table.
+    size_t Entries() const { return page_size_ / sizeof(off_t); }
+
+    // Table pages needed to cover `pages` logical pages.
+    size_t TablePages(size_t pages) const {
+        return (pages + Entries() - 1) / Entries();
+    }
+
+    // Superblocks take the first two kMinPageSize bytes, pages of the tree
+    // start at the first page after them.
+    off_t DataStart() const {
+        return std::max<off_t>(kMetaOffset + 2 * kMinPageSize, page_size_);
+    }
+
+    // Start an empty file in shadow mode.
+    void Format() {
+        shadow_ = true;
+        end_ = DataStart();
+        Grow(end_);
+        WriteSuperblock(0, 0, 0);
+        Sync();
+    }
+
+    // Load the table of the newest valid superblock, a file without one was
+    // not created in shadow mode.
+    void LoadTable() {
+        if (file_size_.load() < kMetaOffset + static_cast<off_t>(2 * kMinPageSize)) {
+            return;
+        }
+        const Superblock* newest = nullptr;
+        for (size_t i = 0; i < 2; ++i) {
+            auto* superblock = reinterpret_cast<const Superblock*>(
+                    Physical(kMetaOffset + i * kMinPageSize));
+            if (superblock->Valid() &&
+                    (newest == nullptr || superblock->generation > newest->generation)) {
+                newest = superblock;
+            }
+        }
+        if (newest == nullptr) return;
+        shadow_ = true;
+        page_size_ = newest->page_size;
+        generation_ = newest->generation;
+        pages_ = newest->pages;
+
+        // 1. Walk the directory, then the table pages it points to.
+        std::set<off_t> used;
+        size_t n = TablePages(pages_);
+        for (off_t of_dir = newest->directory; table_pages_.size() < n;) {
+            directory_.push_back(of_dir);
+            used.insert(of_dir);
+            auto* dir = reinterpret_cast<const off_t*>(Physical(of_dir));
+            for (size_t i = 1; i < Entries() && table_pages_.size() < n; ++i) {
+                table_pages_.push_back(dir[i]);
+            }
+            of_dir = dir[0];
+        }
+        for (size_t t = 0; t < n; ++t) {
+            if (table_pages_[t] == 0) continue;
+            used.insert(table_pages_[t]);
+            auto* entries = reinterpret_cast<const off_t*>(Physical(table_pages_[t]));
+            for (size_t i = 0; i < Entries() && t * Entries() + i < pages_; ++i) {
+                if (entries[i] == 0) continue;
+                SetTranslation((t * Entries() + i) * page_size_, entries[i]);
+                used.insert(entries[i]);
+            }
+        }
+
+        // 2. Pages of the file which are not used are free.
+        end_ = DataStart();
+        if (!used.empty()) {
+            end_ = std::max(end_, *used.rbegin() + static_cast<off_t>(page_size_));
+        }
+        for (off_t offset = DataStart(); offset < end_; offset += page_size_) {
+            if (used.count(offset) == 0) free_.insert(offset);
+        }
+    }
+
+    off_t Allocate() {
+        if (!free_.empty()) {
+            off_t offset = *free_.begin();
+            free_.erase(free_.begin());
+            return offset;
+        }
+        off_t offset = end_;
+        end_ += page_size_;
+        if (end_ > file_size_.load()) Grow(end_);
+        return offset;
+    }
+
+    // Point the superblock of `generation` at the table.
+    void WriteSuperblock(uint64_t generation, off_t directory, size_t pages) {
+        auto* superblock = reinterpret_cast<Superblock*>(
+                Physical(kMetaOffset + generation % 2 * kMinPageSize));
+        superblock->magic = kShadowMagic;
+        superblock->generation = generation;
+        superblock->directory = directory;
+        superblock->pages = pages;
+        superblock->page_size = page_size_;
+        superblock->checksum = superblock->Sum();
+    }
+
+    // Write pages of a batch and the table pages they change to free pages
+    // of the file, then flip the superblock. Pages the batch replaced are
+    // free once it is committed. Table pages at or beyond `limit` are moved
+    // too.
+    void Commit(const std::vector<std::pair<off_t, const char*>>& pages,
+                            off_t limit = std::numeric_limits<off_t>::max()) {
+        if (pages.empty() && truncate_ < 0 &&
+                limit == std::numeric_limits<off_t>::max()) {
+            return;
+        }
+        Reclaim();
+        size_t old_pages = pages_;
+        size_t count = truncate_ < 0 ? pages_ : truncate_ / page_size_;
+
+        // 1. Copy pages of the batch.
+        std::vector<std::pair<off_t, off_t>> moved;
+        for (auto& page : pages) {
+            off_t physical = Allocate();
+            std::memcpy(Physical(physical), page.second, page_size_);
+            moved.emplace_back(page.first, physical);
+            count = std::max<size_t>(count, page.first / page_size_ + 1);
+        }
+
+        // 2. Rewrite table pages with changed entries.
+        std::map<size_t, std::vector<off_t>> changed;
+        auto entries = [&](size_t t) -> std::vector<off_t>& {
+            std::vector<off_t>& e = changed[t];
+            if (e.empty()) {
+                e.resize(Entries(), 0);
+                for (size_t i = 0; i < Entries(); ++i) {
+                    size_t page = t * Entries() + i;
+                    if (page < std::min(pages_, count)) e[i] = Translate(page * page_size_);
+                }
+            }
+            return e;
+        };
+        for (auto& m : moved) {
+            size_t page = m.first / page_size_;
+            entries(page / Entries())[page % Entries()] = m.second;
+        }
+        if (count < pages_ && count % Entries() != 0) entries(count / Entries());
+        for (size_t t = 0; t < std::min(table_pages_.size(), TablePages(count));
+                 ++t) {
+            if (table_pages_[t] >= limit) entries(t);
+        }
+        std::vector<off_t> freed;
+        std::vector<off_t> table_pages(table_pages_);
+        table_pages.resize(TablePages(count), 0);
+        for (size_t t = table_pages.size(); t < table_pages_.size(); ++t) {
+            if (table_pages_[t] != 0) freed.push_back(table_pages_[t]);
+        }
+        for (auto& c : changed) {
+            off_t& of_table = table_pages[c.first];
+            if (of_table != 0) freed.push_back(of_table);
+            of_table = 0;
+            if (std::all_of(c.second.begin(), c.second.end(),
+                                            [](off_t e) { return e == 0; })) {
+                continue;
+            }
+            of_table = Allocate();
+            std::memcpy(Physical(of_table), c.second.data(), page_size_);
+        }
+
+        // 3. Rewrite the directory, a chain of pages listing table pages.
+        freed.insert(freed.end(), directory_.begin(), directory_.end());
+        std::vector<off_t> directory;
+        for (size_t t = 0; t < table_pages.size(); t += Entries() - 1) {
+            directory.push_back(Allocate());
+        }
+        for (size_t d = 0; d < directory.size(); ++d) {
+            auto* dir = reinterpret_cast<off_t*>(Physical(directory[d]));
+            std::memset(dir, 0, page_size_);
+            dir[0] = d + 1 < directory.size() ? directory[d + 1] : 0;
+            for (size_t i = 1, t = d * (Entries() - 1);
+                     i < Entries() && t < table_pages.size(); ++i, ++t) {
+                dir[i] = table_pages[t];
+            }
+        }
+
+        // 4. Flip the superblock once everything it points to is on disk.
+        Sync();
+        WriteSuperblock(generation_ + 1, directory.empty() ? 0 : directory[0],
+                                        count);
+        Sync();
+
+        // 5. Publish the new translations.
+        for (auto& m : moved) {
+            Latch(m.first);
+            off_t old = Translate(m.first);
+            if (old != 0) freed.push_back(old);
+            SetTranslation(m.first, m.second);
+        }
+        for (size_t page = count; page < old_pages; ++page) {
+            off_t old = Translate(page * page_size_);
+            if (old == 0) continue;
+            Latch(page * page_size_);
+            freed.push_back(old);
+            SetTranslation(page * page_size_, 0);
+        }
+        {
+            // Snapshots taken before may still read the freed pages.
+            std::lock_guard<std::mutex> lock(views_mutex_);
+            ++generation_;
+            pages_ = count;
+            table_pages_.swap(table_pages);
+            directory_.swap(directory);
+            if (views_.empty()) {
+                free_.insert(freed.begin(), freed.end());
+            } else {
+                retired_[generation_] = std::move(freed);
+            }
+        }
+
+        if (truncate_ < 0) return;
+        truncate_ = -1;
+        Shrink();
+    }
+
+    // Free pages retired by commits which no snapshot can see anymore.
+    void Reclaim() {
+        std::lock_guard<std::mutex> lock(views_mutex_);
+        auto end = views_.empty() ? retired_.end()
+                                                            : retired_.upper_bound(*views_.begin());
+        for (auto it = retired_.begin(); it != end; ++it) {
+            free_.insert(it->second.begin(), it->second.end());
+        }
+        retired_.erase(retired_.begin(), end);
+    }
+
+    // Move used pages from the tail of file to free pages before it, then
+    // cut the file. Replaced pages are only free after a commit, so this
+    // takes a few rounds.
+    void Shrink() {
+        for (int round = 0; round < 3; ++round) {
+            while (!free_.empty() &&
+                         *free_.rbegin() + static_cast<off_t>(page_size_) == end_) {
+                end_ = *free_.rbegin();
+                free_.erase(std::prev(free_.end()));
+            }
+            if (free_.empty()) break;
+            off_t limit = end_ - static_cast<off_t>(free_.size() * page_size_);
+            std::vector<std::pair<off_t, const char*>> pages;
+            for (size_t page = 0; page < pages_; ++page) {
+                off_t physical = Translate(page * page_size_);
+                if (physical >= limit) {
+                    pages.emplace_back(page * page_size_, Physical(physical));
+                }
+            }
+            Commit(pages, limit);
+        }
+        TruncateFile(end_);
+    }
+
+#ifndef _WIN32
+    // Boundaries of mmap are aligned to the system page, which may be
+    // larger than kMinPageSize.
+    static off_t SystemPageSize() {
+        static const off_t page_size = sysconf(_SC_PAGE_SIZE);
+        return page_size;
+    }
+
+    static off_t AlignDown(off_t offset) {
+        return offset / SystemPageSize() * SystemPageSize();
+    }
+
+    static off_t AlignUp(off_t offset) {
+        return AlignDown(offset + SystemPageSize() - 1);
+    }
+
+    // Map [begin, end) of every mapped region to the file, or to anonymous
+    // pages. Both replace the old mapping at once.
+    void Remap(off_t begin, off_t end, bool file) {
+        for (size_t i = 0; i < kMaxRegions; ++i) {
+            Region* region = regions_[i].load();
+            if (region == nullptr) continue;
+            off_t start = static_cast<off_t>(i * kRegionSize);
+            off_t from = std::max(begin, start);
+            off_t to = std::min(end, start + static_cast<off_t>(kRegionSize));
+            if (from >= to) continue;
+            void* addr = region->addr + (from - start);
+            void* res = file ? mmap(addr, to - from, PROT_READ | PROT_WRITE,
+                                                            MAP_SHARED | MAP_FIXED, fd_, from)
+                                             : mmap(addr, to - from, PROT_READ | PROT_WRITE,
+                                                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+                                                            -1, 0);
+            if (MAP_FAILED == res) Exit("mmap");
+        }
+    }
+#endif
+
+    // Grow file in steps of kGrowSize so that it covers `size` bytes.
+    void Grow(off_t size) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        off_t new_size = (size + kGrowSize - 1) / kGrowSize * kGrowSize;
+#ifdef _WIN32
+        HANDLE hFile = FileHandle();
+        LARGE_INTEGER newSize;
+        newSize.QuadPart = new_size;
+        if (!SetFilePointerEx(hFile, newSize, NULL, FILE_BEGIN) ||
+                !SetEndOfFile(hFile)) {
+            Exit("SetFilePointerEx/SetEndOfFile");
+        }
+#else
+        if (ftruncate(fd_, new_size) != 0) Exit("ftruncate");
+        Remap(AlignDown(file_size_.load()), new_size, true);
+#endif
+        file_size_.store(new_size);
+    }
+
+    Region* MapRegion(size_t index) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Region* region = regions_[index].load();
+        if (region != nullptr) return region;
+        region = new Region();
+        off_t offset = static_cast<off_t>(index) * kRegionSize;
+#ifdef _WIN32
+        // A mapping object can not outgrow the file, so it covers the whole
+        // region and extends the file up to the end of region.
+        LARGE_INTEGER end;
+        end.QuadPart = offset + kRegionSize;
+        HANDLE hMapFile = CreateFileMapping(FileHandle(), NULL, PAGE_READWRITE,
+                                                                             end.HighPart, end.LowPart, NULL);
+        if (hMapFile == NULL) Exit("CreateFileMapping");
+        LARGE_INTEGER start;
+        start.QuadPart = offset;
+        void* addr = MapViewOfFile(hMapFile, FILE_MAP_ALL_ACCESS, start.HighPart,
+                                                             start.LowPart, kRegionSize);
+        if (addr == NULL) {
+            CloseHandle(hMapFile);
+            Exit("MapViewOfFile");
+        }
+        region->hMapFile = hMapFile;
+        if (file_size_.load() < end.QuadPart) file_size_.store(end.QuadPart);
+#else
+        // Reserve the region with anonymous pages, then map the part of it
+        // inside the file.
+        void* addr = mmap(nullptr, kRegionSize, PROT_READ | PROT_WRITE,
+                                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (MAP_FAILED == addr) Exit("mmap");
+        off_t size = std::min(file_size_.load() - offset,
+                                                    static_cast<off_t>(kRegionSize));
+        if (size > 0 && MAP_FAILED == mmap(addr, size, PROT_READ | PROT_WRITE,
+                                                                             MAP_SHARED | MAP_FIXED, fd_, offset)) {
+            Exit("mmap");
+        }
+#endif
+        region->addr = static_cast<char*>(addr);
+        regions_[index].store(region, std::memory_order_release);
+        return region;
+    }
+
+    // `number` counts extents from the start of file.
+    void Touch(Region* region, size_t number, bool pin) {
+        std::atomic<uint8_t>& state = region->extents[number % kExtents];
+        uint8_t s = state.load(std::memory_order_relaxed);
+        if (s == kPinned) return;
+        if (pin) {
+            Pin(state, number);
+            return;
+        }
+        if (s == kCold || s == kHotReferenced) return;
+        if (s == kHot) {
+            state.compare_exchange_strong(s, kHotReferenced);
+            return;
+        }
+
+        // The extent comes in. Touches while it is cold do not count, so a
+        // scan passing through leaves hot extents alone.
+        std::lock_guard<std::mutex> lock(clock_mutex_);
+        s = state.load();
+        if (s != kAbsent && s != kGhost) return;
+        ++resident_;
+        Uncheck(region, number % kExtents);
+        if (s == kGhost) {
+            state.store(kHot);
+            hot_.push_back(number);
+        } else {
+            state.store(kCold);
+            cold_.push_back(number);
+        }
+        Evict();
+    }
+
+    // Keep extent resident for good. Nodes move and pinned extents may end
+    // up holding anything, so once they take half of the budget they are
+    // all made hot and pinned again as they are read.
+    void Pin(std::atomic<uint8_t>& state, size_t number) {
+        std::lock_guard<std::mutex> lock(clock_mutex_);
+        uint8_t s = state.load();
+        if (s == kPinned) return;
+        if (pinned_.size() >= budget_ / 2) {
+            for (size_t n : pinned_) {
+                uint8_t expected = kPinned;
+                if (regions_[n / kExtents].load()->extents[n % kExtents]
+                                .compare_exchange_strong(expected, kHot)) {
+                    hot_.push_back(n);
+                }
+            }
+            pinned_.clear();
+        }
+        // Queued entries of the extent are dropped by Evict() as stale.
+        if (s == kAbsent || s == kGhost) {
+            ++resident_;
+            Uncheck(regions_[number / kExtents].load(), number % kExtents);
+        }
+        state.store(kPinned);
+        pinned_.push_back(number);
+        Evict();
+    }
+
+    // Release extents until the budget holds. Cold extents leave first while
+    // they take more than a quarter of it, hot ones get a second chance
+    // from the CLOCK hand when referenced. Entries whose extent changed
+    // state since they were queued are dropped.
+    void Evict() {
+        while (resident_.load() > budget_ && (!cold_.empty() || !hot_.empty())) {
+            if (!cold_.empty() && (cold_.size() > budget_ / 4 || hot_.empty())) {
+                size_t number = cold_.front();
+                cold_.pop_front();
+                Region* region = regions_[number / kExtents].load();
+                uint8_t s = kCold;
+                if (!region->extents[number % kExtents].compare_exchange_strong(
+                                s, kGhost)) {
+                    continue;
+                }
+                Release(region, number % kExtents, kCold);
+                // Remember it for a while, coming back soon makes it hot.
+                ghosts_.push_back(number);
+                if (ghosts_.size() > budget_ / 2) {
+                    number = ghosts_.front();
+                    ghosts_.pop_front();
+                    s = kGhost;
+                    regions_[number / kExtents].load()->extents[number % kExtents]
+                            .compare_exchange_strong(s, kAbsent);
+                }
+                continue;
+            }
+            if (hand_ >= hot_.size()) hand_ = 0;
+            size_t number = hot_[hand_];
+            Region* region = regions_[number / kExtents].load();
+            std::atomic<uint8_t>& state = region->extents[number % kExtents];
+            uint8_t s = kHotReferenced;
+            if (state.compare_exchange_strong(s, kHot)) {
+                ++hand_;
+                continue;
+            }
+            if (s == kHot && state.compare_exchange_strong(s, kAbsent)) {
+                Release(region, number % kExtents, kHot);
+            }
+            hot_[hand_] = hot_.back();
+            hot_.pop_back();
+        }
+    }
+
+    // Pages of an extent which comes in are read from the file again.
+    static void Uncheck(Region* region, size_t extent) {
+        constexpr size_t kPages = kExtentSize / kMinPageSize;
+        static_assert(64 % kPages == 0, "Extent must not span words.");
+        size_t page = extent * kPages;
+        region->checked[page / 64].fetch_and(
+                ~(((uint64_t(1) << kPages) - 1) << page % 64),
+                std::memory_order_relaxed);
+    }
+
+    // Hand extent back to the OS, `state` is what it was before absent.
+    void Release(Region* region, size_t extent, uint8_t state) {
+        if (state == kAbsent || state == kGhost) return;
+        char* addr = region->addr + extent * kExtentSize;
+#ifdef _WIN32
+        // Unlocking pages which are not locked drops them from working set.
+        VirtualUnlock(addr, kExtentSize);
+#else
+        // Shared mapping, dirty pages are kept by the page cache.
+        if (madvise(addr, kExtentSize, MADV_DONTNEED) != 0) Exit("madvise");
+#endif
+        --resident_;
+    }
+
+#ifdef _WIN32
+    HANDLE FileHandle() const {
+        HANDLE hFile = (HANDLE)_get_osfhandle(fd_);
+        if (hFile == INVALID_HANDLE_VALUE) Exit("_get_osfhandle");
+        return hFile;
+    }
+#endif
+
+    struct Region {
+        Region() : addr(nullptr) {
+#ifdef _WIN32
+            hMapFile = NULL;
+#endif
+            for (auto& extent : extents) extent.store(kAbsent);
+            for (auto& word : checked) word.store(0);
+        }
+
+        char* addr;
+        std::atomic<uint8_t> extents[kExtents];
+        // Pages of kMinPageSize checked since their extent came in.
+        std::atomic<uint64_t> checked[kRegionSize / kMinPageSize / 64];
+#ifdef _WIN32
+        HANDLE hMapFile;
+#endif
+    };
+
+    // Translations of the logical pages of one region.
+    struct Chunk {
+        Chunk() {
+            for (auto& entry : entries) entry.store(0);
+        }
+
+        std::atomic<off_t> entries[kRegionSize / kMinPageSize];
+    };
+
+    struct Superblock {
+        uint64_t Sum() const {
+            return Checksum(reinterpret_cast<const char*>(this),
+                                            offsetof(Superblock, checksum));
+        }
+        bool Valid() const { return magic == kShadowMagic && checksum == Sum(); }
+
+        uint64_t magic;
+        uint64_t generation;    // bumped by every commit
+        off_t directory;        // first page of directory
+        uint64_t pages;         // logical pages covered by the table
+        uint64_t page_size;
+        uint64_t checksum;
+    };
+
+    int fd_;
+    std::atomic<off_t> file_size_;
+    size_t page_size_;
+    std::mutex mutex_;    // guards mapping and size of file
+    std::atomic<Region*> regions_[kMaxRegions];
+    std::atomic<size_t> resident_;    // extents
+    size_t budget_;                   // extents
+    std::mutex clock_mutex_;          // guards queues below
+    std::deque<size_t> cold_;         // FIFO of cold extents
+    std::vector<size_t> hot_;         // CLOCK of hot extents
+    size_t hand_;
+    std::deque<size_t> ghosts_;       // FIFO of recently released cold extents
+    std::vector<size_t> pinned_;      // may hold stale entries
+    std::atomic<uint64_t> versions_[kLatchStripes];
+    std::vector<std::atomic<uint64_t>*> latched_;
+    std::set<off_t> written_;    // nodes changed in place, to be sealed
+    bool batch_;
+    std::map<off_t, std::unique_ptr<char[]>> copies_;    // pages of batch
+    bool shadow_;
+    char zeros_[kMaxPageSize];
+    std::atomic<Chunk*> table_[kMaxRegions];    // logical to file offset
+    uint64_t generation_;
+    size_t pages_;                              // logical pages in table
+    std::vector<off_t> table_pages_;
+    std::vector<off_t> directory_;
+    off_t end_;                                 // end of used pages of file
+    std::set<off_t> free_;                      // unused pages before end_
+    off_t truncate_;                            // logical end, or -1
+    std::mutex views_mutex_;    // guards the table of last commit and below
+    std::multiset<uint64_t> views_;             // generations of snapshots
+    std::map<uint64_t, std::vector<off_t>> retired_;    // freed by generation
+};
+
+// Serializes writers, pages touched by a writer stay latched until it is
+// done.
+class BPlusTree::WriteGuard {
+ public:
+    // A batch writes to private copies of pages, nothing is latched before
+    // it ends. In shadow mode every writer runs a batch, which commits when
+    // the guard goes away, or is dropped when an exception does.
+    WriteGuard(BPlusTree* tree, bool batch = false)
+            : tree_(tree),
+                batch_(batch || tree->block_cache_->Shadow()),
+                exceptions_(std::uncaught_exceptions()) {
+        tree_->write_mutex_.lock();
+        if (batch_) {
+            tree_->block_cache_->BeginBatch();
+        } else {
+            tree_->block_cache_->Latch(kMetaOffset);
+        }
+        tree_->meta_ = tree_->map<Meta>(kMetaOffset);
+    }
+
+    ~WriteGuard() {
+        if (batch_) {
+            if (std::uncaught_exceptions() > exceptions_) {
+                tree_->block_cache_->AbortBatch();
+            } else {
+                tree_->block_cache_->EndBatch();
+            }
+            // The copy of Meta is gone.
+            tree_->meta_ = tree_->block_cache_->get<Meta>(kMetaOffset);
+        }
+        tree_->block_cache_->UnlatchAll();
+        tree_->write_mutex_.unlock();
+    }
+
+ private:
+    BPlusTree* tree_;
+    bool batch_;
+    int exceptions_;    // in flight when the guard was made
+};
+
+// Redo log of write batches. A commit appends one record holding images of
+// all pages it changed and syncs once:
+//     | magic | count | checksum | offset | page | ... | offset | page |
+// Replay stops at the first record which is torn or corrupted.
+class BPlusTree::Wal {
+    struct Header {
+        uint32_t magic;
+        uint32_t count;       // number of pages
+        uint64_t checksum;    // of the pages with their offsets
+    };
+    static constexpr uint32_t kMagic = 0x4c415742;
+
+ public:
+    Wal(const char* path, size_t page_size)
+            : page_size_(page_size), entry_size_(sizeof(off_t) + page_size) {
+#ifdef _WIN32
+        fd_ = _open(path, _O_CREAT | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
+        if (fd_ == -1) Exit("open");
+        size_ = _lseeki64(fd_, 0, SEEK_END);
+#else
+        fd_ = open(path, O_CREAT | O_RDWR, 0600);
+        if (fd_ == -1) Exit("open");
+        size_ = lseek(fd_, 0, SEEK_END);
+#endif
+        if (size_ < 0) Exit("lseek");
+    }
+
+    ~Wal() {
+#ifdef _WIN32
+        _close(fd_);
+#else
+        close(fd_);
+#endif
+    }
+
+    off_t size() const { return size_; }
+
+    void Append(const std::vector<std::pair<off_t, const char*>>& pages) {
+        if (pages.empty()) return;
+        std::string record(sizeof(Header), '\0');
+        record.reserve(sizeof(Header) + pages.size() * entry_size_);
+        for (auto& page : pages) {
+            record.append(reinterpret_cast<const char*>(&page.first), sizeof(off_t));
+            record.append(page.second, page_size_);
+        }
+        Header header;
+        header.magic = kMagic;
+        header.count = static_cast<uint32_t>(pages.size());
+        header.checksum = Checksum(record.data() + sizeof(Header),
+                                                             record.size() - sizeof(Header));
+        std::memcpy(&record[0], &header, sizeof(Header));
+        WriteAt(size_, record.data(), record.size());
+        Sync();
+        size_ += record.size();
+    }
+
+    // Call `apply` with every page of complete records, oldest first.
+    void Replay(const std::function<void(off_t, const char*)>& apply) {
+        off_t pos = 0;
+        Header header;
+        std::string body;
+        while (pos + static_cast<off_t>(sizeof(Header)) <= size_) {
+            ReadAt(pos, &header, sizeof(Header));
+            off_t end = pos + sizeof(Header) + header.count * entry_size_;
+            if (header.magic != kMagic || end > size_) break;
+            body.resize(header.count * entry_size_);
+            ReadAt(pos + sizeof(Header), &body[0], body.size());
+            if (Checksum(body.data(), body.size()) != header.checksum) break;
+            for (size_t i = 0; i < header.count; ++i) {
+                off_t offset;
+                std::memcpy(&offset, &body[i * entry_size_], sizeof(off_t));
+                apply(offset, &body[i * entry_size_ + sizeof(off_t)]);
+            }
+            pos = end;
+        }
+    }
+
+    // Drop all records once the data file has them.
+    void Truncate() {
+#ifdef _WIN32
+        if (_chsize_s(fd_, 0) != 0) Exit("_chsize_s");
+#else
+        if (ftruncate(fd_, 0) != 0) Exit("ftruncate");
+#endif
+        Sync();
+        size_ = 0;
+    }
+
+ private:
+    void WriteAt(off_t pos, const char* data, size_t size) {
+#ifdef _WIN32
+        if (_lseeki64(fd_, pos, SEEK_SET) != pos) Exit("lseek");
+        while (size > 0) {
+            int n = _write(fd_, data, static_cast<unsigned>(std::min<size_t>(size, 1 << 30)));
+            if (n <= 0) Exit("write");
+            data += n;
+            size -= n;
+        }
+#else
+        while (size > 0) {
+            ssize_t n = pwrite(fd_, data, size, pos);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) Exit("pwrite");
+            data += n;
+            pos += n;
+            size -= n;
+        }
+#endif
+    }
+
+    void ReadAt(off_t pos, void* buf, size_t size) {
+        char* data = static_cast<char*>(buf);
+#ifdef _WIN32
+        if (_lseeki64(fd_, pos, SEEK_SET) != pos) Exit("lseek");
+        while (size > 0) {
+            int n = _read(fd_, data, static_cast<unsigned>(std::min<size_t>(size, 1 << 30)));
+            if (n <= 0) Exit("read");
+            data += n;
+            size -= n;
+        }
+#else
+        while (size > 0) {
+            ssize_t n = pread(fd_, data, size, pos);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) Exit("pread");
+            data += n;
+            pos += n;
+            size -= n;
+        }
+#endif
+    }
+
+    void Sync() {
+#ifdef _WIN32
+        if (_commit(fd_) != 0) Exit("_commit");
+#else
+        if (fsync(fd_) != 0) Exit("fsync");
+#endif
+    }
+
+    int fd_;
+    off_t size_;
+    size_t page_size_;
+    size_t entry_size_;    // offset and page
+};
+
+// A caller of write() waiting in queue.
+struct BPlusTree::Writer {
+    const WriteBatch* batch;
+    bool done;
+    std::exception_ptr error;    // why the batch was not applied
+    std::condition_variable cv;
+};
+
+BPlusTree::BPlusTree(const char* path, const Options& options) {
+    if (options.page_size < kMinPageSize || options.page_size > kMaxPageSize ||
+            (options.page_size & (options.page_size - 1)) != 0) {
+        throw std::invalid_argument("page size must be a power of two from 4 to 16 KB");
+    }
+#ifdef _WIN32
+    fd_ = _open(path, _O_CREAT | _O_RDWR | _O_BINARY, _S_IREAD | _S_IWRITE);
 #else
     fd_ = open(path, O_CREAT | O_RDWR, 0600);
 #endif
     if (fd_ == -1) Exit("open");
-    
-    meta_ = map<Meta>(kMetaOffset);
+    block_cache_ = new BlockCache(fd_, options.mode == CommitMode::kShadow,
+                                                                options.page_size, options.cache_size);
+    page_size_ = block_cache_->PageSize();
+    pinned_levels_ = options.pinned_levels;
+    wal_ = nullptr;
+    if (!block_cache_->Shadow()) {
+        wal_ = new Wal((std::string(path) + "-wal").c_str(), page_size_);
+    }
+
+    WriteGuard guard(this);
+    if (wal_ != nullptr) {
+        // Redo batches committed to log but maybe not to file yet.
+        wal_->Replay([this](off_t offset, const char* page) {
+            std::memcpy(block_cache_->get<char>(offset), page, page_size_);
+        });
+        checkpoint();
+    }
+
     if (meta_->height == 0) {
         // Initialize B+tree;
-        constexpr off_t of_root = kMetaOffset + sizeof(Meta);
-        LeafNode* root = new (map<LeafNode>(of_root)) LeafNode();
+        const off_t of_root = kMetaOffset + page_size_;
+        LeafNode* root = new (map<LeafNode>(of_root)) LeafNode(page_size_);
         root->offset = of_root;
         meta_->height = 1;
         meta_->root = of_root;
-        meta_->block = of_root + sizeof(LeafNode);
+        meta_->block = of_root + page_size_;
+        meta_->page_size = page_size_;
+        meta_->filter_bits = options.bloom_bits_per_key;
         unmap<LeafNode>(root);
+        // Page size must be in the file before the log holds any page.
+        if (wal_ != nullptr) block_cache_->Sync();
     }
 }
 
 BPlusTree::~BPlusTree() {
     unmap(meta_);
+    delete wal_;
     delete block_cache_;
 #ifdef _WIN32
     _close(fd_);
@@ -462,197 +2198,1223 @@ BPlusTree::~BPlusTree() {
 }
 
 void BPlusTree::upsert(const std::string& key, const std::string& value) {
+    if (key.size() > kMaxKeySize) throw std::length_error("key is too long");
+    WriteGuard guard(this);
+    checkpoint();
+    insert(key, value);
+}
+
+bool BPlusTree::remove(const std::string& key) {
+    WriteGuard guard(this);
+    checkpoint();
+    return erase(key);
+}
+
+bool BPlusTree::append_posting(const std::string& key, uint64_t posting) {
+    if (key.size() > kMaxKeySize) throw std::length_error("key is too long");
+    WriteGuard guard(this);
+    checkpoint();
+    return update_postings(key, posting, true);
+}
+
+bool BPlusTree::remove_posting(const std::string& key, uint64_t posting) {
+    WriteGuard guard(this);
+    checkpoint();
+    return update_postings(key, posting, false);
+}
+
+void WriteBatch::upsert(const std::string& key, const std::string& value) {
+    if (key.size() > kMaxKeySize) throw std::length_error("key is too long");
+    ops_.push_back({Op::kUpsert, key, value, 0});
+}
+
+void WriteBatch::remove(const std::string& key) {
+    ops_.push_back({Op::kRemove, key, std::string(), 0});
+}
+
+void WriteBatch::append_posting(const std::string& key, uint64_t posting) {
+    if (key.size() > kMaxKeySize) throw std::length_error("key is too long");
+    ops_.push_back({Op::kAppendPosting, key, std::string(), posting});
+}
+
+void WriteBatch::remove_posting(const std::string& key, uint64_t posting) {
+    ops_.push_back({Op::kRemovePosting, key, std::string(), posting});
+}
+
+void BPlusTree::write(const WriteBatch& batch) {
+    // 1. Queue up, the writer in front commits all batches queued so far.
+    Writer writer{&batch, false, nullptr, {}};
+    std::unique_lock<std::mutex> lock(queue_mutex_);
+    writers_.push_back(&writer);
+    while (!writer.done && &writer != writers_.front()) writer.cv.wait(lock);
+    if (writer.done) {
+        if (writer.error) std::rethrow_exception(writer.error);
+        return;
+    }
+    std::vector<Writer*> group(writers_.begin(), writers_.end());
+    lock.unlock();
+
+    // 2. Apply the batches to private copies of pages, log the changed pages
+    // with a single sync and then publish them. In shadow mode the guard
+    // commits them instead. If an update throws, the copies are dropped and
+    // the whole group fails.
+    std::exception_ptr error;
+    try {
+        WriteGuard guard(this, true);
+        // Posting updates of a key which holds a value would throw halfway,
+        // a batch with one of them fails on its own before anything is
+        // applied. `values` tells which keys hold a value after the batches
+        // checked so far.
+        std::map<std::string, bool> values;
+        for (Writer* w : group) {
+            std::map<std::string, bool> changed;
+            auto holds = [&](const std::string& key) {
+                auto it = changed.find(key);
+                if (it != changed.end()) return it->second;
+                it = values.find(key);
+                return it != values.end() ? it->second : holds_value(key);
+            };
+            bool valid = true;
+            for (const WriteBatch::Op& op : w->batch->ops_) {
+                bool posting = op.kind == WriteBatch::Op::kAppendPosting ||
+                                             op.kind == WriteBatch::Op::kRemovePosting;
+                if (posting && holds(op.key)) {
+                    valid = false;
+                    break;
+                }
+                changed[op.key] = op.kind == WriteBatch::Op::kUpsert;
+            }
+            if (!valid) {
+                w->error = std::make_exception_ptr(
+                        std::invalid_argument("value is not a posting list"));
+                continue;
+            }
+            for (auto& c : changed) values[c.first] = c.second;
+        }
+
+        for (Writer* w : group) {
+            if (w->error) continue;
+            for (const WriteBatch::Op& op : w->batch->ops_) {
+                switch (op.kind) {
+                    case WriteBatch::Op::kUpsert:
+                        insert(op.key, op.value);
+                        break;
+                    case WriteBatch::Op::kRemove:
+                        erase(op.key);
+                        break;
+                    case WriteBatch::Op::kAppendPosting:
+                        update_postings(op.key, op.posting, true);
+                        break;
+                    case WriteBatch::Op::kRemovePosting:
+                        update_postings(op.key, op.posting, false);
+                        break;
+                }
+            }
+        }
+        if (wal_ != nullptr) {
+            wal_->Append(block_cache_->DirtyPages());
+            block_cache_->EndBatch();
+            if (wal_->size() > kMaxWalSize) checkpoint();
+        }
+    } catch (...) {
+        error = std::current_exception();
+    }
+
+    // 3. Wake up the group and hand over to the next writer.
+    lock.lock();
+    for (size_t i = 0; i < group.size(); ++i) {
+        Writer* w = writers_.front();
+        writers_.pop_front();
+        if (w == &writer) continue;
+        if (error) w->error = error;
+        w->done = true;
+        w->cv.notify_one();
+    }
+    if (!writers_.empty()) writers_.front()->cv.notify_one();
+    lock.unlock();
+    if (error) std::rethrow_exception(error);
+    if (writer.error) std::rethrow_exception(writer.error);
+}
+
+// Write the mapping through to the file, the log is not needed after that.
+void BPlusTree::checkpoint() {
+    if (wal_ == nullptr || wal_->size() == 0) return;
+    block_cache_->Sync();
+    wal_->Truncate();
+}
+
+void BPlusTree::insert(const std::string& key, const std::string& value,
+                                             uint16_t flags) {
     // 1. Find Leaf node.
-    off_t of_leaf = get_leaf_offset(key.data());
+    off_t of_leaf = get_leaf_offset(key);
     LeafNode* leaf_node = map<LeafNode>(of_leaf);
-    if (insert_kv_into_leaf_node(leaf_node, key.data(), value.data()) <=
-            get_max_keys()) {
-        // 2.If records of leaf node less than or equals kOrder - 1 then finish.
+    std::string record = make_record(key, value, flags);
+    int index = insert_kv_into_leaf_node(leaf_node, key, record);
+    if (index < 0) {
+        // 2.If the record fits into leaf node then finish.
         unmap<LeafNode>(leaf_node);
         return;
     }
 
     // 3. Split leaf node to two leaf nodes.
-    LeafNode* split_node = split_leaf_node(leaf_node);
-    const char* mid_key = split_node->FirstKey();
+    LeafNode* split_node = split_leaf_node(leaf_node, index, record);
+    std::string mid_key =
+            ShortestSeparator(leaf_node->LastKey(), split_node->FirstKey());
     IndexNode* parent_node = get_or_create_parent(leaf_node);
     off_t of_parent = leaf_node->parent;
     split_node->parent = of_parent;
+    off_t of_left = leaf_node->offset;
+    off_t of_right = split_node->offset;
+    unmap<LeafNode>(leaf_node);
+    unmap<LeafNode>(split_node);
 
     // 4.Insert key to parent of splited leaf nodes and
     // link two splited left nodes to parent.
-    if (insert_key_into_index_node(parent_node, mid_key, leaf_node, split_node) <=
-            get_max_keys()) {
-        unmap<LeafNode>(leaf_node);
-        unmap<LeafNode>(split_node);
+    if (insert_key_into_index_node(parent_node, mid_key, of_left, of_right)) {
         unmap<IndexNode>(parent_node);
         return;
     }
 
     // 5.Split index node from bottom to up repeatedly
-    // until count <= kOrder - 1.
-    size_t count;
+    // until the key fits into parent.
+    bool inserted;
     do {
         IndexNode* child_node = parent_node;
-        IndexNode* split_node = split_index_node(child_node);
-        const char* mid_key = child_node->Key(child_node->count);
+        IndexNode* split_node =
+                split_index_node(child_node, mid_key, of_left, of_right);
         parent_node = get_or_create_parent(child_node);
         of_parent = child_node->parent;
         split_node->parent = of_parent;
-        count =
-                insert_key_into_index_node(parent_node, mid_key, child_node, split_node);
+        of_left = child_node->offset;
+        of_right = split_node->offset;
+        inserted =
+                insert_key_into_index_node(parent_node, mid_key, of_left, of_right);
         unmap<IndexNode>(child_node);
-    } while (count > get_max_keys());
+        unmap<IndexNode>(split_node);
+    } while (!inserted);
     unmap<IndexNode>(parent_node);
 }
 
-bool BPlusTree::remove(const std::string& key) {
-    off_t of_leaf = get_leaf_offset(key.data());
-    LeafNode* leaf_node = map<LeafNode>(of_leaf);
-    // 1. remove key from leaf node
-    int index = get_index_from_leaf_node(leaf_node, key.data());
-    if (index == -1) {
-        unmap(leaf_node);
-        return false;
+bool BPlusTree::erase(const std::string& key) {
+    off_t of_leaf = get_leaf_offset(key);
+    LeafNode* leaf_node = map<LeafNode>(of_leaf);
+    // 1. remove key from leaf node
+    int index = get_index_from_leaf_node(leaf_node, key);
+    if (index == -1) {
+        unmap(leaf_node);
+        return false;
+    }
+
+    free_value(leaf_node, index);
+    leaf_node->DeleteKVAtIndex(index);
+    --meta_->size;
+    // 2. If leaf_node is root then return.
+    if (leaf_node->parent == 0) {
+        unmap(leaf_node);
+        return true;
+    }
+
+    // 3. If leaf_node is still filled enough then return else execute step 3.
+    if (!leaf_node->Underflow()) {
+        unmap(leaf_node);
+        return true;
+    }
+
+    // 4. If borrow from siblings successfully then return else execute step 4.
+    if (borrow_from_leaf_sibling(leaf_node)) {
+        unmap<LeafNode>(leaf_node);
+        return true;
+    }
+
+    // 5. Merge two leaf nodes. If neither sibling has room left, leaf_node
+    // simply stays underfull.
+    if (!merge_leaf(leaf_node)) {
+        unmap<LeafNode>(leaf_node);
+        return true;
+    }
+
+    IndexNode* index_node = map<IndexNode>(leaf_node->parent);
+    unmap<LeafNode>(leaf_node);
+
+    // 6. If index_node is still filled enough then return or execute 6.
+    // 7. If one of sibling can spare a key then swap its key and parent's
+    // key then return or execute 7.
+    // 8. Merge index_node and its' parent and sibling.
+    while (index_node->parent != 0 && index_node->Underflow() &&
+                 !borrow_from_index_sibling(index_node) && merge_index(index_node)) {
+        IndexNode* old_index_node = index_node;
+        index_node = map<IndexNode>(old_index_node->parent);
+        unmap(old_index_node);
+    }
+
+    if (index_node->parent == 0 && index_node->count == 0) {
+        // 9. Root is removed, update new root and height.
+        Node* new_root = map<Node>(index_node->Child(0));
+        assert(new_root->left == 0);
+        assert(new_root->right == 0);
+        new_root->parent = 0;
+        meta_->root = new_root->offset;
+        --meta_->height;
+        unmap(new_root);
+        dealloc(index_node);
+        return true;
+    }
+
+    unmap<IndexNode>(index_node);
+    return true;
+}
+
+// Add `posting` to the list of `key` or remove it from there, and return
+// whether the list changed. A list which becomes empty takes its key along.
+bool BPlusTree::update_postings(const std::string& key, uint64_t posting,
+                                                                bool add) {
+    // 1. Find the list, its last posting leads it.
+    const LeafNode* leaf_node = peek<LeafNode>(get_leaf_offset(key));
+    int index = get_index_from_leaf_node(leaf_node, key);
+    if (index == -1) {
+        if (!add) return false;
+        insert(key, EncodePostings({posting}), LeafNode::kPostings);
+        return true;
+    }
+    if (!leaf_node->IsPostings(index)) {
+        throw std::invalid_argument("value is not a posting list");
+    }
+    const bool overflow = leaf_node->IsOverflow(index);
+    uint64_t last;
+    std::memcpy(&last,
+                            overflow ? peek<OverflowNode>(leaf_node->OverflowOffset(index))->Data()
+                                             : leaf_node->Value(index).data(),
+                            sizeof(last));
+
+    // 2. Appending in ascending order, the common case, adds a gap at the
+    // end. A spilled list only changes in its first and last page.
+    if (add && posting > last) {
+        std::string gap;
+        PutVarint(gap, posting - last);
+        if (!overflow) {
+            std::string value(leaf_node->Value(index));
+            std::memcpy(&value[0], &posting, sizeof(posting));
+            insert(key, value + gap, LeafNode::kPostings);
+            return true;
+        }
+        LeafNode* leaf = map<LeafNode>(leaf_node->offset);
+        OverflowNode* first = map<OverflowNode>(leaf->OverflowOffset(index));
+        std::memcpy(first->Data(), &posting, sizeof(posting));
+        off_t of_tail = first->left;
+        if (of_tail == 0) {
+            of_tail = first->offset;
+            while (peek<OverflowNode>(of_tail)->right != 0) {
+                of_tail = peek<OverflowNode>(of_tail)->right;
+            }
+        }
+        OverflowNode* tail =
+                of_tail == first->offset ? first : map<OverflowNode>(of_tail);
+        size_t n = std::min(gap.size(),
+                                                page_size_ - sizeof(OverflowNode) - tail->count);
+        std::memcpy(tail->Data() + tail->count, gap.data(), n);
+        tail->count += n;
+        first->left = tail->offset;
+        if (n < gap.size()) {
+            tail->right = write_overflow(std::string_view(gap).substr(n));
+            OverflowNode* next = map<OverflowNode>(tail->right);
+            first->left = next->offset;
+            next->left = 0;
+            unmap(next);
+        }
+        leaf->SetValueSize(index, leaf->ValueSize(index) + gap.size());
+        if (tail != first) unmap(tail);
+        unmap(first);
+        unmap(leaf);
+        return true;
+    }
+
+    // 3. Otherwise decode the whole list, change it and store it back.
+    std::string value;
+    if (!overflow) {
+        value.assign(leaf_node->Value(index));
+    } else {
+        value.reserve(leaf_node->ValueSize(index));
+        for (off_t offset = leaf_node->OverflowOffset(index); offset != 0;) {
+            const OverflowNode* node = peek<OverflowNode>(offset);
+            value.append(node->Data(), node->count);
+            offset = node->right;
+        }
+    }
+    std::vector<uint64_t> postings;
+    DecodePostings(value, postings);
+    auto it = std::lower_bound(postings.begin(), postings.end(), posting);
+    if ((it != postings.end() && *it == posting) == add) return false;
+    if (add) {
+        postings.insert(it, posting);
+    } else {
+        postings.erase(it);
+    }
+    if (postings.empty()) return erase(key);
+    insert(key, EncodePostings(postings), LeafNode::kPostings);
+    return true;
+}
+
+// Whether `key` holds a value rather than a posting list, for the writer.
+bool BPlusTree::holds_value(const std::string& key) const {
+    const LeafNode* leaf_node = peek<LeafNode>(get_leaf_offset(key));
+    int index = get_index_from_leaf_node(leaf_node, key);
+    return index != -1 && !leaf_node->IsPostings(index);
+}
+
+bool BPlusTree::get(const std::string& key, std::string& value) const {
+    return get(key, value, nullptr);
+}
+
+bool BPlusTree::get_postings(const std::string& key,
+                                                         std::vector<uint64_t>& postings) const {
+    return get_postings(key, postings, nullptr);
+}
+
+bool BPlusTree::get_postings(const std::string& key,
+                                                         std::vector<uint64_t>& postings,
+                                                         const View* view) const {
+    std::string value;
+    uint16_t flags;
+    if (!get(key, value, view, &flags)) {
+        postings.clear();
+        return false;
+    }
+    if ((flags & LeafNode::kPostings) == 0) {
+        throw std::invalid_argument("value is not a posting list");
+    }
+    DecodePostings(value, postings);
+    return true;
+}
+
+bool BPlusTree::get(const std::string& key, std::string& value,
+                                        const View* view, uint16_t* flags) const {
+    alignas(LeafNode) char page[kMaxPageSize];
+    const LeafNode* leaf_node = reinterpret_cast<const LeafNode*>(page);
+    // A key the filter rules out is not in the tree.
+    if (filter_excludes(key, view)) return false;
+    while (true) {
+        // 1. Copy leaf node, start over if a writer changed the path.
+        uint64_t version;
+        if (!read_leaf(key, page, version, view)) continue;
+
+        // 2. The copy is consistent, search it.
+        int index = get_index_from_leaf_node(leaf_node, key);
+        if (index == -1) return false;
+        if (flags != nullptr) *flags = leaf_node->Flags(index);
+
+        // 3. Read value, start over if the leaf changed meanwhile.
+        if (read_value(leaf_node, index, version, value, view)) return true;
+    }
+}
+
+// Only writers map blocks, readers copy them with read_node().
+template <typename T>
+T* BPlusTree::map(off_t offset) const {
+    block_cache_->Latch(offset);
+    return block_cache_->get<T>(offset);
+}
+
+// Node for a writer which only reads it, it is neither latched nor sealed
+// afterwards.
+template <typename T>
+const T* BPlusTree::peek(off_t offset) const {
+    return block_cache_->get<T>(offset, false);
+}
+
+template <typename T>
+void BPlusTree::unmap(T*) const {
+    // Blocks stay mapped as long as the tree is open, nothing to release.
+}
+
+BPlusTree::IndexNode* BPlusTree::get_or_create_parent(Node* node) {
+    if (node->parent == 0) {
+        // Split root node.
+        IndexNode* parent_node = alloc<IndexNode>();
+        parent_node->PutCell(0, 0, std::string_view(), node->offset);
+        node->parent = parent_node->offset;
+        meta_->root = parent_node->offset;
+        ++meta_->height;
+        return parent_node;
+    }
+    return map<IndexNode>(node->parent);
+}
+
+template <typename T>
+int BPlusTree::upper_bound(const T* node, int n, std::string_view key) const {
+    // Keys of node share prefix, so only compare the rest of them.
+    int cmp = key.substr(0, node->prefix).compare(node->Prefix());
+    if (cmp != 0) return cmp < 0 ? 0 : n;
+    key.remove_prefix(node->prefix);
+    // Only slots whose hint ties with key need a full compare.
+    int l, r;
+    node->HintRange(n, Node::Hint(key), l, r);
+    --r;
+    while (l <= r) {
+        int mid = (l + r) >> 1;
+        if (node->Suffix(mid).compare(key) <= 0) {
+            l = mid + 1;
+        } else {
+            r = mid - 1;
+        }
+    }
+    return l;
+}
+
+template <typename T>
+int BPlusTree::lower_bound(const T* node, int n, std::string_view key) const {
+    int cmp = key.substr(0, node->prefix).compare(node->Prefix());
+    if (cmp != 0) return cmp < 0 ? 0 : n;
+    key.remove_prefix(node->prefix);
+    int l, r;
+    node->HintRange(n, Node::Hint(key), l, r);
+    --r;
+    while (l <= r) {
+        int mid = (l + r) >> 1;
+        if (node->Suffix(mid).compare(key) < 0) {
+            l = mid + 1;
+        } else {
+            r = mid - 1;
+        }
+    }
+    return l;
+};
+
+template <typename T>
+T* BPlusTree::alloc() {
+    // 1. Reuse a freed page if there is one.
+    if (meta_->free_page != 0) {
+        off_t offset = meta_->free_page;
+        T* node = map<T>(offset);
+        meta_->free_page = node->right;
+        node = new (node) T(page_size_);
+        node->offset = offset;
+        return node;
+    }
+
+    // 2. Otherwise append a new page at the end of file.
+    T* node = new (map<T>(meta_->block)) T(page_size_);
+    node->offset = meta_->block;
+    meta_->block += page_size_;
+    return node;
+}
+
+template <typename T>
+void BPlusTree::dealloc(T* node) {
+    // Push page to the free list, chained by `right`.
+    node->parent = 0;
+    node->left = 0;
+    node->count = 0;
+    node->right = meta_->free_page;
+    meta_->free_page = node->offset;
+    unmap<T>(node);
+}
+
+std::set<off_t> BPlusTree::free_pages() const {
+    std::set<off_t> pages;
+    off_t offset = meta_->free_page;
+    while (offset != 0) {
+        pages.insert(offset);
+        offset = peek<Node>(offset)->right;
+    }
+    return pages;
+}
+
+void BPlusTree::set_free_pages(const std::set<off_t>& pages) {
+    // Link in descending order so that the list starts at the lowest offset.
+    meta_->free_page = 0;
+    for (auto it = pages.rbegin(); it != pages.rend(); ++it) {
+        Node* node = map<Node>(*it);
+        node->parent = 0;
+        node->left = 0;
+        node->count = 0;
+        node->right = meta_->free_page;
+        meta_->free_page = *it;
+        unmap(node);
+    }
+}
+
+void BPlusTree::shrink_to_fit() {
+    WriteGuard guard(this);
+    checkpoint();
+    // 1. Gather all freed pages and those of the filter, which would keep
+    // the tail in use otherwise.
+    std::set<off_t> pages = free_pages();
+    const bool filter = meta_->filter != 0;
+    for (size_t i = 0; i < meta_->filter_pages; ++i) {
+        pages.insert(meta_->filter + static_cast<off_t>(i * page_size_));
+    }
+    meta_->filter = 0;
+    meta_->filter_pages = 0;
+
+    // 2. Cut freed pages from the tail of file as long as they are contiguous.
+    off_t end = meta_->block;
+    while (!pages.empty() &&
+                 *pages.rbegin() + static_cast<off_t>(page_size_) == end) {
+        end = *pages.rbegin();
+        pages.erase(std::prev(pages.end()));
+    }
+
+    // 3. Rebuild free list with the remaining pages, so that alloc hands out
+    // low offsets first.
+    if (end != meta_->block || filter) set_free_pages(pages);
+
+    // 4. Build the filter again at the new end of file.
+    meta_->block = end;
+    if (meta_->filter_bits != 0) rebuild_filter();
+
+    // 5. Truncate file, this also drops the room reserved by growing it in
+    // chunks.
+    block_cache_->Truncate(meta_->block);
+}
+
+void BPlusTree::compact(double fill_factor) {
+    if (!(fill_factor > 0 && fill_factor <= 1)) {
+        throw std::invalid_argument("fill factor must be in (0, 1]");
+    }
+    {
+        // One batch, readers and a crash see either the old tree or the new
+        // one.
+        WriteGuard guard(this, true);
+        if (meta_->size == 0) return;
+        // 1. Gather the pages of all nodes and find the first leaf. Overflow
+        // pages of values stay where they are.
+        std::set<off_t> pages = free_pages();
+        off_t of_leaf = 0;
+        std::vector<std::pair<off_t, size_t>> nodes{{meta_->root, 1}};
+        while (!nodes.empty()) {
+            auto cur = nodes.back();
+            nodes.pop_back();
+            pages.insert(cur.first);
+            if (cur.second < meta_->height) {
+                const IndexNode* index_node = peek<IndexNode>(cur.first);
+                for (size_t i = index_node->count + 1; i-- > 0;) {
+                    nodes.emplace_back(index_node->Child(i), cur.second + 1);
+                }
+            } else if (of_leaf == 0) {
+                of_leaf = cur.first;
+            }
+        }
+
+        // 2. Free all nodes and the filter and build the tree again. Pages
+        // are handed out from the lowest offset, so leaves follow each other
+        // in key order with index nodes after them. The old leaves are
+        // streamed from the mapping, which the batch leaves alone until it
+        // ends. shrink_to_fit() builds the filter again, until then lookups
+        // go without one.
+        for (size_t i = 0; i < meta_->filter_pages; ++i) {
+            pages.insert(meta_->filter + static_cast<off_t>(i * page_size_));
+        }
+        meta_->filter = 0;
+        meta_->filter_pages = 0;
+        set_free_pages(pages);
+        const LeafNode* leaf_node = nullptr;
+        size_t i = 0;
+        std::pair<off_t, size_t> tree = build(
+                [&](std::string& record) {
+                    while (leaf_node == nullptr || i == leaf_node->count) {
+                        if (of_leaf == 0) return false;
+                        leaf_node = reinterpret_cast<const LeafNode*>(
+                                block_cache_->Read(of_leaf));
+                        of_leaf = leaf_node->right;
+                        i = 0;
+                    }
+                    record = leaf_node->Record(i++);
+                    return true;
+                },
+                fill_factor);
+        meta_->root = tree.first;
+        meta_->height = tree.second;
+        if (wal_ != nullptr) {
+            wal_->Append(block_cache_->DirtyPages());
+            block_cache_->EndBatch();
+            checkpoint();
+        }
+    }
+    // 3. Give back the pages left free at the end of file.
+    shrink_to_fit();
+}
+
+std::vector<std::string> BPlusTree::verify(size_t threads) {
+    if (threads == 0) {
+        threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    const Meta* meta = reinterpret_cast<const Meta*>(block_cache_->Peek(kMetaOffset));
+    std::vector<std::string> problems;
+    if (meta->height == 0) {
+        problems.push_back("tree has no root");
+        return problems;
+    }
+    auto in_file = [&](off_t offset) {
+        return offset > kMetaOffset && offset < meta->block &&
+                     offset % static_cast<off_t>(page_size_) == 0;
+    };
+
+    // 1. Check the pages of the filter, keys are looked up in it below.
+    std::vector<off_t> pages;
+    const size_t blocks = FilterNode::Blocks(page_size_);
+    bool filter = meta->filter != 0;
+    for (size_t i = 0; i < meta->filter_pages; ++i) {
+        off_t offset = meta->filter + static_cast<off_t>(i * page_size_);
+        if (!in_file(offset)) {
+            problems.push_back("filter leaves the file");
+            filter = false;
+            break;
+        }
+        pages.push_back(offset);
+        auto* node = reinterpret_cast<const Node*>(block_cache_->Peek(offset));
+        if (node->checksum != 0 && node->checksum != node->Sum(page_size_)) {
+            problems.push_back("page at " + std::to_string(offset) +
+                                                 ": checksum mismatch");
+        }
+    }
+    auto in_filter = [&](std::string_view key) {
+        const uint64_t hash = FilterNode::Hash(key);
+        const size_t block = FilterNode::BlockOf(hash, meta->filter_pages * blocks);
+        auto* node = reinterpret_cast<const FilterNode*>(block_cache_->Peek(
+                meta->filter + static_cast<off_t>(block / blocks * page_size_)));
+        return FilterNode::MayContain(node->Block(block % blocks), hash,
+                                                                    FilterNode::Probes(meta->filter_bits));
+    };
+
+    // Node to check with what its parent says about it.
+    struct Item {
+        off_t offset;
+        off_t parent;
+        std::string low, high;    // keys of node are in [low, high)
+        bool bounded;             // whether high applies
+    };
+    // What one thread found on a part of a level.
+    struct Part {
+        std::vector<Item> children;
+        std::vector<off_t> pages;
+        std::vector<std::string> problems;
+        size_t keys = 0;
+    };
+    auto check = [&](const std::vector<Item>& items, size_t i, bool leaf,
+                                     Part& part) {
+        const Item& item = items[i];
+        auto fail = [&](off_t offset, const char* what) {
+            part.problems.push_back("page at " + std::to_string(offset) + ": " + what);
+        };
+        if (!in_file(item.offset)) {
+            fail(item.offset, "outside of file");
+            return;
+        }
+        part.pages.push_back(item.offset);
+        auto* node = reinterpret_cast<const Node*>(block_cache_->Peek(item.offset));
+        if (node->checksum != 0 && node->checksum != node->Sum(page_size_)) {
+            fail(item.offset, "checksum mismatch");
+        }
+        if (node->offset != item.offset) fail(item.offset, "wrong offset");
+        if (node->parent != item.parent) fail(item.offset, "wrong parent");
+        if (node->left != (i > 0 ? items[i - 1].offset : 0)) {
+            fail(item.offset, "wrong left sibling");
+        }
+        if (node->right != (i + 1 < items.size() ? items[i + 1].offset : 0)) {
+            fail(item.offset, "wrong right sibling");
+        }
+
+        if (leaf) {
+            auto* leaf_node = static_cast<const LeafNode*>(node);
+            if (!leaf_node->Intact(page_size_)) {
+                fail(item.offset, "cells outside of page");
+                return;
+            }
+            part.keys += leaf_node->count;
+            std::string prev;
+            for (size_t k = 0; k < leaf_node->count; ++k) {
+                std::string key = leaf_node->Key(k);
+                if (key < item.low || (item.bounded && key >= item.high) ||
+                        (k > 0 && key <= prev)) {
+                    fail(item.offset, "keys out of order");
+                    break;
+                }
+                if (filter && !in_filter(key)) {
+                    fail(item.offset, "key missing from filter");
+                }
+                prev.swap(key);
+                if (!leaf_node->IsOverflow(k)) continue;
+                // Overflow pages must add up to the value.
+                size_t size = 0;
+                off_t offset = leaf_node->OverflowOffset(k);
+                while (offset != 0 && size < leaf_node->ValueSize(k)) {
+                    if (!in_file(offset)) {
+                        fail(offset, "outside of file");
+                        break;
+                    }
+                    part.pages.push_back(offset);
+                    auto* overflow =
+                            reinterpret_cast<const OverflowNode*>(block_cache_->Peek(offset));
+                    if (overflow->checksum != 0 &&
+                            overflow->checksum != overflow->Sum(page_size_)) {
+                        fail(offset, "checksum mismatch");
+                    }
+                    if (overflow->count == 0 ||
+                            overflow->count > page_size_ - sizeof(OverflowNode)) {
+                        fail(offset, "bad overflow size");
+                        break;
+                    }
+                    size += overflow->count;
+                    offset = overflow->right;
+                }
+                if (offset != 0 || size != leaf_node->ValueSize(k)) {
+                    fail(item.offset, "overflow pages do not match value");
+                }
+            }
+            return;
+        }
+
+        auto* index_node = static_cast<const IndexNode*>(node);
+        if (!index_node->Intact(page_size_)) {
+            fail(item.offset, "cells outside of page");
+            return;
+        }
+        std::string low = item.low;
+        for (size_t k = 0; k <= index_node->count; ++k) {
+            bool last = k == index_node->count;
+            std::string high = last ? item.high : index_node->Key(k);
+            if (!last && (high < low || (k > 0 && high == low) ||
+                                        (item.bounded && high > item.high))) {
+                fail(item.offset, "keys out of order");
+            }
+            part.children.push_back({index_node->Child(k), item.offset, low, high,
+                                                              last ? item.bounded : true});
+            low.swap(high);
+        }
+    };
+
+    // 2. Check the tree level by level, each level is split among threads.
+    size_t keys = 0;
+    std::vector<Item> level{{meta->root, 0, std::string(), std::string(), false}};
+    for (size_t depth = 1; !level.empty(); ++depth) {
+        const bool leaf = depth == meta->height;
+        const size_t n = std::min(threads, (level.size() + 63) / 64);
+        std::vector<Part> parts(n);
+        auto run = [&](size_t p) {
+            for (size_t i = level.size() * p / n; i < level.size() * (p + 1) / n;
+                     ++i) {
+                check(level, i, leaf, parts[p]);
+            }
+        };
+        std::vector<std::thread> workers;
+        for (size_t p = 1; p < n; ++p) workers.emplace_back(run, p);
+        run(0);
+        for (auto& worker : workers) worker.join();
+
+        level.clear();
+        for (auto& part : parts) {
+            level.insert(level.end(), std::make_move_iterator(part.children.begin()),
+                                     std::make_move_iterator(part.children.end()));
+            pages.insert(pages.end(), part.pages.begin(), part.pages.end());
+            problems.insert(problems.end(), part.problems.begin(), part.problems.end());
+            keys += part.keys;
+        }
+    }
+    if (keys != meta->size) {
+        problems.push_back("tree holds " + std::to_string(keys) + " keys, " +
+                                             std::to_string(meta->size) + " expected");
     }
 
-    leaf_node->DeleteKVAtIndex(index);
-    --meta_->size;
-    // 2. If leaf_node is root then return.
-    if (leaf_node->parent == 0) {
-        unmap(leaf_node);
-        return true;
+    // 3. Walk the free list, it must not be longer than the file.
+    size_t limit = meta->block / page_size_;
+    for (off_t offset = meta->free_page; offset != 0;) {
+        if (!in_file(offset) || limit-- == 0) {
+            problems.push_back("free list leaves the file");
+            break;
+        }
+        pages.push_back(offset);
+        auto* node = reinterpret_cast<const Node*>(block_cache_->Peek(offset));
+        if (node->checksum != 0 && node->checksum != node->Sum(page_size_)) {
+            problems.push_back("page at " + std::to_string(offset) +
+                                                 ": checksum mismatch");
+        }
+        offset = node->right;
     }
 
-    // 3. If count of leaf_node >= get_min_keys() then return else execute step 3.
-    if (leaf_node->count >= get_min_keys()) {
-        unmap(leaf_node);
-        return true;
+    // 4. No page may be used twice.
+    std::sort(pages.begin(), pages.end());
+    for (size_t i = 1; i < pages.size(); ++i) {
+        if (pages[i] == pages[i - 1] && (i == 1 || pages[i] != pages[i - 2])) {
+            problems.push_back("page at " + std::to_string(pages[i]) +
+                                                 ": used more than once");
+        }
     }
+    return problems;
+}
 
-    // 4. If borrow from siblings successfully then return else execute step 4.
-    if (borrow_from_leaf_sibling(leaf_node)) {
-        unmap<LeafNode>(leaf_node);
-        return true;
+void BPlusTree::bulk_load(
+        const std::function<bool(std::string&, std::string&)>& next,
+        double fill_factor) {
+    if (!(fill_factor > 0 && fill_factor <= 1)) {
+        throw std::invalid_argument("fill factor must be in (0, 1]");
+    }
+    WriteGuard guard(this);
+    if (meta_->size != 0) throw std::logic_error("tree is not empty");
+    checkpoint();
+
+    std::string key, value, last_key;
+    size_t size = 0;
+    std::pair<off_t, size_t> tree = build(
+            [&](std::string& record) {
+                if (!next(key, value)) return false;
+                if (key.size() > kMaxKeySize) throw std::length_error("key is too long");
+                if (size > 0 && key <= last_key) {
+                    throw std::invalid_argument("keys are not sorted or not unique");
+                }
+                record = make_record(key, value);
+                last_key.swap(key);
+                ++size;
+                return true;
+            },
+            fill_factor);
+    if (size == 0) return;
+
+    // Free the old empty tree and switch to the new one.
+    std::vector<std::pair<off_t, size_t>> old_nodes{{meta_->root, 1}};
+    while (!old_nodes.empty()) {
+        auto cur = old_nodes.back();
+        old_nodes.pop_back();
+        if (cur.second < meta_->height) {
+            IndexNode* index_node = map<IndexNode>(cur.first);
+            for (size_t i = 0; i <= index_node->count; ++i) {
+                old_nodes.emplace_back(index_node->Child(i), cur.second + 1);
+            }
+            dealloc(index_node);
+        } else {
+            dealloc(map<LeafNode>(cur.first));
+        }
     }
+    meta_->root = tree.first;
+    meta_->height = tree.second;
+    meta_->size = size;
+    if (meta_->filter_bits != 0) rebuild_filter();
+}
 
-    // 5. Merge two leaf nodes.
-    leaf_node = merge_leaf(leaf_node);
+std::pair<off_t, size_t> BPlusTree::build(
+        const std::function<bool(std::string&)>& next, double fill_factor) {
+    const size_t budget =
+            static_cast<size_t>((page_size_ - sizeof(Node)) * fill_factor);
+
+    // 1. Fill leaf nodes from left to right. Records of the next leaf are
+    // gathered first so that it is packed with its prefix at once.
+    IndexNode::Cells cells;    // leaf nodes with separators between them
+    LeafNode::Records records;
+    size_t records_size = 0;    // bytes of records and slots without prefix
+    std::string record;
+    LeafNode* prev_leaf = nullptr;
+    auto flush_leaf = [&]() {
+        LeafNode* leaf_node = alloc<LeafNode>();
+        leaf_node->Rebuild(records, 0, records.size());
+        if (prev_leaf != nullptr) {
+            cells.back().first =
+                    ShortestSeparator(prev_leaf->LastKey(), leaf_node->FirstKey());
+            prev_leaf->right = leaf_node->offset;
+            leaf_node->left = prev_leaf->offset;
+            unmap(prev_leaf);
+        }
+        cells.emplace_back(std::string(), leaf_node->offset);
+        prev_leaf = leaf_node;
+        records.clear();
+        records_size = 0;
+    };
+    try {
+        while (next(record)) {
+            size_t record_size = record.size() + sizeof(Slot);
+            if (!records.empty()) {
+                size_t p = Node::CommonPrefix(LeafNode::RecordKey(records[0]),
+                                                                            LeafNode::RecordKey(record));
+                if (records_size + record_size - records.size() * p > budget) {
+                    flush_leaf();
+                }
+            }
+            records.push_back(std::move(record));
+            records_size += record_size;
+        }
+        if (records.empty()) return {0, 0};
+        flush_leaf();
+    } catch (...) {
+        // Give back what has been built so far.
+        if (!records.empty()) flush_leaf();
+        if (prev_leaf != nullptr) unmap(prev_leaf);
+        for (auto& cell : cells) {
+            LeafNode* leaf_node = map<LeafNode>(cell.second);
+            for (size_t i = 0; i < leaf_node->count; ++i) free_value(leaf_node, i);
+            dealloc(leaf_node);
+        }
+        throw;
+    }
+    unmap(prev_leaf);
+
+    // 2. Build index nodes level by level. Each one takes as many children
+    // as fit, the key after its last child moves up to the next level.
+    size_t height = 1;
+    while (cells.size() > 1) {
+        IndexNode::Cells parents;
+        IndexNode* prev_node = nullptr;
+        size_t begin = 0;
+        while (begin < cells.size()) {
+            size_t end = begin + 2;
+            while (end < cells.size() &&
+                         IndexNode::PackedSize(cells, begin, end + 1) <= budget) {
+                ++end;
+            }
+            // Leave at least two children to the last node.
+            if (cells.size() - end == 1) --end;
+            end = std::min(end, cells.size());
+
+            IndexNode* index_node = alloc<IndexNode>();
+            index_node->Rebuild(cells, begin, end);
+            for (size_t i = begin; i < end; ++i) {
+                Node* child_node = map<Node>(cells[i].second);
+                child_node->parent = index_node->offset;
+                unmap(child_node);
+            }
+            if (prev_node != nullptr) {
+                prev_node->right = index_node->offset;
+                index_node->left = prev_node->offset;
+                unmap(prev_node);
+            }
+            parents.emplace_back(std::move(cells[end - 1].first), index_node->offset);
+            prev_node = index_node;
+            begin = end;
+        }
+        unmap(prev_node);
+        parents.back().first.clear();
+        cells.swap(parents);
+        ++height;
+    }
+    return {cells[0].second, height};
+}
 
-    IndexNode* index_node = map<IndexNode>(leaf_node->parent);
-    unmap<LeafNode>(leaf_node);
+std::string BPlusTree::make_record(const std::string& key,
+                                                                     const std::string& value,
+                                                                     uint16_t flags) {
+    // Values longer than a sixteenth of page go to a chain of overflow pages.
+    if (value.size() <= page_size_ / 16) {
+        return LeafNode::MakeRecord(key, value, flags, value.size());
+    }
+    off_t of_overflow = write_overflow(value);
+    return LeafNode::MakeRecord(
+            key,
+            std::string_view(reinterpret_cast<const char*>(&of_overflow),
+                                             sizeof(of_overflow)),
+            flags | LeafNode::kOverflow, value.size());
+}
 
-    // 6. If count of index_node >= get_min_keys() then return or execute 6.
-    // 7. If count of one of sibling > get_min_keys() then swap its key and parent's
-    // key then return or execute 7.
-    while (index_node->parent != 0 && index_node->count < get_min_keys() &&
-                 !borrow_from_index_sibling(index_node)) {
-        // 8. Merge index_node and its' parent and sibling.
-        IndexNode* old_index_node = merge_index(index_node);
-        index_node = map<IndexNode>(old_index_node->parent);
-        unmap(old_index_node);
+off_t BPlusTree::write_overflow(std::string_view value) {
+    const size_t chunk_size = page_size_ - sizeof(OverflowNode);
+    off_t of_head = 0;
+    OverflowNode* prev = nullptr;
+    for (size_t pos = 0; pos < value.size(); pos += chunk_size) {
+        OverflowNode* node = alloc<OverflowNode>();
+        node->count = std::min(chunk_size, value.size() - pos);
+        std::memcpy(node->Data(), value.data() + pos, node->count);
+        if (prev == nullptr) {
+            of_head = node->offset;
+        } else {
+            prev->right = node->offset;
+            unmap(prev);
+        }
+        prev = node;
     }
+    if (prev->offset == of_head) {
+        prev->left = of_head;
+    } else {
+        OverflowNode* head = map<OverflowNode>(of_head);
+        head->left = prev->offset;
+        unmap(head);
+    }
+    unmap(prev);
+    return of_head;
+}
 
-    if (index_node->parent == 0 && index_node->count == 0) {
-        // 9. Root is removed, update new root and height.
-        Node* new_root = map<Node>(index_node->indexes[0].offset);
-        assert(new_root->left == 0);
-        assert(new_root->right == 0);
-        new_root->parent = 0;
-        meta_->root = new_root->offset;
-        --meta_->height;
-        unmap(new_root);
-        dealloc(index_node);
+bool BPlusTree::read_value(const LeafNode* leaf_node, int index,
+                                                     uint64_t version, std::string& value,
+                                                     const View* view) const {
+    if (!leaf_node->IsOverflow(index)) {
+        value.assign(leaf_node->Value(index));
         return true;
     }
-
-    unmap<IndexNode>(index_node);
+    // Overflow pages only change along with their leaf node, so each one is
+    // checked against the version of leaf node.
+    alignas(OverflowNode) char page[kMaxPageSize];
+    const OverflowNode* node = reinterpret_cast<const OverflowNode*>(page);
+    value.clear();
+    value.reserve(leaf_node->ValueSize(index));
+    off_t offset = leaf_node->OverflowOffset(index);
+    while (offset != 0) {
+        uint64_t page_version;
+        if (!read_node(offset, leaf_node->offset, version, page, page_version,
+                                     view)) {
+            return false;
+        }
+        value.append(node->Data(), node->count);
+        offset = node->right;
+    }
     return true;
 }
 
-bool BPlusTree::get(const std::string& key, std::string& value) const {
-    off_t of_leaf = get_leaf_offset(key.data());
-    LeafNode* leaf_node = map<LeafNode>(of_leaf);
-    int index = get_index_from_leaf_node(leaf_node, key.data());
-    if (index == -1) {
-        unmap<LeafNode>(leaf_node);
-        return false;
+// Copy node at `offset` into `page` and return whether the copy is
+// consistent. The node was reached from `of_parent`, which must not have
+// changed since `parent_version`, otherwise `offset` may be stale. With
+// `pin` the node stays resident. Pages of a snapshot `view` never change.
+bool BPlusTree::read_node(off_t offset, off_t of_parent,
+                                                    uint64_t parent_version, char* page,
+                                                    uint64_t& version, const View* view,
+                                                    bool pin) const {
+    if (view != nullptr) {
+        std::memcpy(page, block_cache_->Read(offset, *view), page_size_);
+        version = 0;
+        return true;
     }
-    value = leaf_node->Value(index);
-    unmap<LeafNode>(leaf_node);
-    return true;
+    version = block_cache_->StableVersion(offset);
+    if (!block_cache_->Validate(of_parent, parent_version)) return false;
+    std::memcpy(page, block_cache_->Read(offset, pin), page_size_);
+    return block_cache_->Validate(offset, version);
 }
 
-template <typename T>
-T* BPlusTree::map(off_t offset) const {
-    return block_cache_->get<T>(fd_, offset);
+// Copy leaf node which may hold `key` into `page`, coupling versions from
+// meta down to the leaf.
+bool BPlusTree::read_leaf(std::string_view key, char* page, uint64_t& version,
+                                                    const View* view) const {
+    // meta_ may be a private copy of a writer, readers go to the mapping.
+    // In shadow mode the page moves on commit, so look it up after the
+    // version was taken.
+    uint64_t parent_version =
+            view != nullptr ? 0 : block_cache_->StableVersion(kMetaOffset);
+    const Meta* meta = reinterpret_cast<const Meta*>(
+            view != nullptr ? block_cache_->Read(kMetaOffset, *view)
+                                            : block_cache_->Read(kMetaOffset, true));
+    off_t of_parent = kMetaOffset;
+    off_t offset = meta->root;
+    size_t height = meta->height;
+    for (size_t level = 1;; ++level) {
+        // Upper index levels are read by every lookup, keep them resident.
+        bool pin = level < height && level <= pinned_levels_;
+        if (!read_node(offset, of_parent, parent_version, page, version, view,
+                                     pin)) {
+            return false;
+        }
+        if (level >= height) return true;
+        const IndexNode* index_node = reinterpret_cast<const IndexNode*>(page);
+        int index = upper_bound(index_node, index_node->count, key);
+        of_parent = offset;
+        parent_version = version;
+        offset = index_node->Child(index);
+    }
 }
 
-template <typename T>
-void BPlusTree::unmap(T* map_obj) const {
-    block_cache_->upsert<T>(map_obj);
+void BPlusTree::free_value(const LeafNode* leaf_node, int index) {
+    if (!leaf_node->IsOverflow(index)) return;
+    off_t offset = leaf_node->OverflowOffset(index);
+    while (offset != 0) {
+        OverflowNode* node = map<OverflowNode>(offset);
+        offset = node->right;
+        dealloc(node);
+    }
 }
 
-constexpr size_t BPlusTree::get_min_keys() const { return (kOrder + 1) / 2 - 1; }
-
-constexpr size_t BPlusTree::get_max_keys() const { return kOrder - 1; }
-
-BPlusTree::IndexNode* BPlusTree::get_or_create_parent(Node* node) {
-    if (node->parent == 0) {
-        // Split root node.
-        IndexNode* parent_node = alloc<IndexNode>();
-        node->parent = parent_node->offset;
-        meta_->root = parent_node->offset;
-        ++meta_->height;
-        return parent_node;
+// Whether the filter rules out `key`. When a writer got in the way the
+// answer is no, the lookup then goes through the tree.
+bool BPlusTree::filter_excludes(std::string_view key, const View* view) const {
+    uint64_t meta_version =
+            view != nullptr ? 0 : block_cache_->StableVersion(kMetaOffset);
+    const Meta* meta = reinterpret_cast<const Meta*>(
+            view != nullptr ? block_cache_->Read(kMetaOffset, *view)
+                                            : block_cache_->Read(kMetaOffset, true));
+    if (meta->filter == 0) return false;
+    const size_t blocks = FilterNode::Blocks(page_size_);
+    const uint64_t hash = FilterNode::Hash(key);
+    const size_t block = FilterNode::BlockOf(hash, meta->filter_pages * blocks);
+    const size_t probes = FilterNode::Probes(meta->filter_bits);
+    const off_t offset =
+            meta->filter + static_cast<off_t>(block / blocks * page_size_);
+    const size_t at = sizeof(Node) + block % blocks * FilterNode::kBlockBits / 8;
+    uint64_t words[FilterNode::kBlockBits / 64];
+    if (view != nullptr) {
+        std::memcpy(words, block_cache_->Read(offset, *view) + at, sizeof(words));
+        return !FilterNode::MayContain(words, hash, probes);
     }
-    return map<IndexNode>(node->parent);
+    // A writer may free the page and publish it before meta, so meta must
+    // not have changed until the block was read.
+    uint64_t version = block_cache_->StableVersion(offset);
+    if (!block_cache_->Validate(kMetaOffset, meta_version)) return false;
+    std::memcpy(words, block_cache_->Read(offset) + at, sizeof(words));
+    return !FilterNode::MayContain(words, hash, probes) &&
+                 block_cache_->Validate(offset, version) &&
+                 block_cache_->Validate(kMetaOffset, meta_version);
 }
 
-template <typename T>
-int BPlusTree::upper_bound(T arr[], int n, const char* key) const {
-    assert(n <= get_max_keys());
-    int l = 0, r = n - 1;
-    while (l <= r) {
-        int mid = (l + r) >> 1;
-        if (std::strncmp(arr[mid].key, key, kMaxKeySize) <= 0) {
-            l = mid + 1;
-        } else {
-            r = mid - 1;
-        }
+// Set the bits of a new `key`. Bits of removed keys stay, so once more keys
+// were set than the filter was sized for, it is built again from the keys
+// which are left, twice as large as they need.
+void BPlusTree::add_to_filter(std::string_view key) {
+    if (meta_->filter_bits == 0) return;
+    const size_t blocks = FilterNode::Blocks(page_size_);
+    if (meta_->filter == 0 ||
+            meta_->filter_keys >= meta_->filter_pages * blocks *
+                                            FilterNode::kBlockBits / meta_->filter_bits) {
+        rebuild_filter();
     }
-    return l;
+    const uint64_t hash = FilterNode::Hash(key);
+    const size_t block = FilterNode::BlockOf(hash, meta_->filter_pages * blocks);
+    FilterNode* node = map<FilterNode>(
+            meta_->filter + static_cast<off_t>(block / blocks * page_size_));
+    FilterNode::Add(node->Block(block % blocks), hash,
+                                    FilterNode::Probes(meta_->filter_bits));
+    ++meta_->filter_keys;
+    unmap(node);
 }
 
-template <typename T>
-int BPlusTree::lower_bound(T arr[], int n, const char* key) const {
-    assert(n <= get_max_keys());
-    int l = 0, r = n - 1;
-    while (l <= r) {
-        int mid = (l + r) >> 1;
-        if (std::strncmp(arr[mid].key, key, kMaxKeySize) < 0) {
-            l = mid + 1;
-        } else {
-            r = mid - 1;
+// Free the filter and build it from all keys in the leaves, sized for twice
+// as many. Its pages are appended at the end of file.
+void BPlusTree::rebuild_filter() {
+    // 1. Free the old filter.
+    for (size_t i = 0; i < meta_->filter_pages; ++i) {
+        dealloc(map<FilterNode>(meta_->filter + static_cast<off_t>(i * page_size_)));
+    }
+    meta_->filter = 0;
+    meta_->filter_pages = 0;
+
+    // 2. Set the bits of all keys in memory, leaves from left to right.
+    const size_t blocks = FilterNode::Blocks(page_size_);
+    const size_t page_bits = blocks * FilterNode::kBlockBits;
+    const size_t pages =
+            (std::max<size_t>(meta_->size, 1) * 2 * meta_->filter_bits + page_bits - 1) /
+            page_bits;
+    const size_t probes = FilterNode::Probes(meta_->filter_bits);
+    std::vector<uint64_t> words(pages * page_bits / 64);
+    size_t keys = 0;
+    off_t offset = meta_->root;
+    for (size_t level = 1; level < meta_->height; ++level) {
+        offset = peek<IndexNode>(offset)->Child(0);
+    }
+    while (offset != 0) {
+        const LeafNode* leaf_node = peek<LeafNode>(offset);
+        for (size_t i = 0; i < leaf_node->count; ++i) {
+            const uint64_t hash = FilterNode::Hash(leaf_node->Key(i));
+            const size_t block = FilterNode::BlockOf(hash, pages * blocks);
+            FilterNode::Add(&words[block * FilterNode::kBlockBits / 64], hash, probes);
         }
+        keys += leaf_node->count;
+        offset = leaf_node->right;
     }
-    return l;
-};
-
-template <typename T>
-T* BPlusTree::alloc() {
-    T* node = new (map<T>(meta_->block)) T();
-    node->offset = meta_->block;
-    meta_->block += sizeof(T);
-    return node;
-}
 
-template <typename T>
-void BPlusTree::dealloc(T* node) {
-    unmap<T>(node);
+    // 3. Write it to pages which follow each other.
+    meta_->filter = meta_->block;
+    meta_->filter_pages = pages;
+    meta_->filter_keys = keys;
+    for (size_t i = 0; i < pages; ++i) {
+        FilterNode* node = new (map<FilterNode>(meta_->block)) FilterNode(page_size_);
+        node->offset = meta_->block;
+        std::memcpy(node->Block(0), &words[i * page_bits / 64], page_bits / 8);
+        meta_->block += page_size_;
+        unmap(node);
+    }
 }
 
-off_t BPlusTree::get_leaf_offset(const char* key) const {
+off_t BPlusTree::get_leaf_offset(std::string_view key) const {
     size_t height = meta_->height;
     off_t offset = meta_->root;
     if (height <= 1) {
@@ -660,64 +3422,86 @@ off_t BPlusTree::get_leaf_offset(const char* key) const {
         return offset;
     }
     // 1. Find bottom index node.
-    IndexNode* index_node = map<IndexNode>(offset);
+    const IndexNode* index_node = peek<IndexNode>(offset);
     while (--height > 1) {
-        int index = upper_bound(index_node->indexes, index_node->count, key);
-        off_t of_child = index_node->indexes[index].offset;
+        int index = upper_bound(index_node, index_node->count, key);
+        off_t of_child = index_node->Child(index);
         unmap(index_node);
-        index_node = map<IndexNode>(of_child);
+        index_node = peek<IndexNode>(of_child);
         offset = of_child;
     }
     // 2. get offset of leaf node.
-    int index = upper_bound(index_node->indexes, index_node->count, key);
-    off_t of_child = index_node->indexes[index].offset;
-    unmap<IndexNode>(index_node);
+    int index = upper_bound(index_node, index_node->count, key);
+    off_t of_child = index_node->Child(index);
+    unmap(index_node);
     return of_child;
 }
 
-inline size_t BPlusTree::insert_key_into_index_node(IndexNode* index_node,
-                                                                                                const char* key,
-                                                                                                Node* left_node,
-                                                                                                Node* right_node) {
-    assert(index_node->count <= get_max_keys());
-    int index = upper_bound(index_node->indexes, index_node->count, key);
-    index_node->InsertIndexAtIndex(index, key, left_node->offset);
-    index_node->UpdateOffset(index + 1, right_node->offset);
-    return index_node->count;
+inline bool BPlusTree::insert_key_into_index_node(IndexNode* index_node,
+                                                                                                std::string_view key,
+                                                                                                off_t of_left,
+                                                                                                off_t of_right) {
+    if (!index_node->CanInsertKey(key)) return false;
+    int index = index_node->ChildIndex(of_left);
+    index_node->InsertIndexAtIndex(index, key, of_left);
+    index_node->UpdateOffset(index + 1, of_right);
+    return true;
 }
 
-size_t BPlusTree::insert_kv_into_leaf_node(LeafNode* leaf_node, const char* key,
-                                                                             const char* value) {
-    assert(leaf_node->count <= get_max_keys());
-    int index = upper_bound(leaf_node->records, leaf_node->count, key);
-    if (index > 0 &&
-            std::strncmp(leaf_node->Key(index - 1), key, kMaxKeySize) == 0) {
-        leaf_node->UpdateValue(index - 1, value);
-        return leaf_node->count;
+int BPlusTree::insert_kv_into_leaf_node(LeafNode* leaf_node,
+                                                                            std::string_view key,
+                                                                            std::string_view record) {
+    int index = upper_bound(leaf_node, leaf_node->count, key);
+    if (index > 0 && leaf_node->KeyEquals(index - 1, key)) {
+        // Replace the old record.
+        free_value(leaf_node, index - 1);
+        leaf_node->DeleteKVAtIndex(--index);
+    } else {
+        ++meta_->size;
+        add_to_filter(key);
     }
 
-    leaf_node->InsertKVAtIndex(index, key, value);
-    ++meta_->size;
-    return leaf_node->count;
+    if (!leaf_node->CanInsertRecord(record)) return index;
+    leaf_node->InsertRecordAtIndex(index, record);
+    return -1;
 }
 
-BPlusTree::LeafNode* BPlusTree::split_leaf_node(LeafNode* leaf_node) {
-    assert(leaf_node->count == kOrder);
-    constexpr int mid = (kOrder - 1) >> 1;
-    constexpr int left_count = mid;
-    constexpr int right_count = kOrder - mid;
-
-    LeafNode* split_node = alloc<LeafNode>();
+BPlusTree::LeafNode* BPlusTree::split_leaf_node(LeafNode* leaf_node, int index,
+                                                                                                std::string_view record) {
+    // 1. Gather records of leaf_node, with the new record at index.
+    LeafNode::Records records = leaf_node->AllRecords();
+    records.emplace(records.begin() + index, record);
+    std::vector<size_t> sizes(records.size() + 1, 0);
+    for (size_t i = 0; i < records.size(); ++i) {
+        sizes[i + 1] = sizes[i] + records[i].size() + sizeof(Slot);
+    }
+    // Bytes taken by records[begin, end) once their prefix is stored once.
+    auto packed_size = [&](size_t begin, size_t end) {
+        size_t p = Node::CommonPrefix(LeafNode::RecordKey(records[begin]),
+                                                                    LeafNode::RecordKey(records[end - 1]));
+        return sizes[end] - sizes[begin] - (end - begin - 1) * p;
+    };
 
-    // Change count.
-    leaf_node->count = left_count;
-    split_node->count = right_count;
+    // 2. Split where both halves fit and are closest in size.
+    size_t mid = 0, best = 0;
+    for (size_t i = 1; i < records.size(); ++i) {
+        size_t left_size = packed_size(0, i);
+        size_t right_size = packed_size(i, records.size());
+        if (std::max(left_size, right_size) > leaf_node->Capacity()) continue;
+        size_t diff = left_size > right_size ? left_size - right_size
+                                                                                 : right_size - left_size;
+        if (mid == 0 || diff < best) {
+            mid = i;
+            best = diff;
+        }
+    }
+    assert(mid > 0);
 
-    // Copy right part of index_node.
-    std::memcpy(&split_node->records[0], &leaf_node->records[mid],
-                            sizeof(split_node->records[0]) * right_count);
+    LeafNode* split_node = alloc<LeafNode>();
+    leaf_node->Rebuild(records, 0, mid);
+    split_node->Rebuild(records, mid, records.size());
 
-    // Link siblings.
+    // 3. Link siblings.
     split_node->left = leaf_node->offset;
     split_node->right = leaf_node->right;
     leaf_node->right = split_node->offset;
@@ -729,31 +3513,56 @@ BPlusTree::LeafNode* BPlusTree::split_leaf_node(LeafNode* leaf_node) {
     return split_node;
 }
 
-BPlusTree::IndexNode* BPlusTree::split_index_node(IndexNode* index_node) {
-    assert(index_node->count == kOrder);
-    constexpr int mid = (kOrder - 1) >> 1;
-    constexpr int left_count = mid;
-    constexpr int right_count = kOrder - mid - 1;
-
-    IndexNode* split_node = alloc<IndexNode>();
+BPlusTree::IndexNode* BPlusTree::split_index_node(IndexNode* index_node,
+                                                                                                    std::string& key,
+                                                                                                    off_t of_left,
+                                                                                                    off_t of_right) {
+    // 1. Gather cells of index_node, with the new key inserted.
+    IndexNode::Cells cells = index_node->AllCells();
+    int index = index_node->ChildIndex(of_left);
+    cells.emplace(cells.begin() + index, key, of_left);
+    cells[index + 1].second = of_right;
+    std::vector<size_t> sizes(cells.size() + 1, 0);
+    for (size_t i = 0; i < cells.size(); ++i) {
+        sizes[i + 1] = sizes[i] + IndexNode::CellSpace(cells[i].first.size());
+    }
+    // Bytes taken by cells[begin, end) once their prefix is stored once.
+    auto packed_size = [&](size_t begin, size_t end) {
+        size_t p = Node::CommonPrefix(cells[begin].first, cells[end - 2].first);
+        return sizes[end - 1] - sizes[begin] + IndexNode::CellSpace(0) -
+                     (end - begin - 2) * p;
+    };
 
-    // Change count.
-    index_node->count = left_count;
-    split_node->count = right_count;
+    // 2. The key at mid moves up, left part keeps cells before it and the
+    // child of mid, right part keeps cells after it. Both parts keep at
+    // least one key and are closest in size.
+    size_t mid = 0, best = 0;
+    for (size_t i = 1; i + 2 < cells.size(); ++i) {
+        size_t left_size = packed_size(0, i + 1);
+        size_t right_size = packed_size(i + 1, cells.size());
+        if (std::max(left_size, right_size) > index_node->Capacity()) continue;
+        size_t diff = left_size > right_size ? left_size - right_size
+                                                                                 : right_size - left_size;
+        if (mid == 0 || diff < best) {
+            mid = i;
+            best = diff;
+        }
+    }
+    assert(mid > 0);
 
-    // Copy right part of index_node.
-    std::memcpy(&split_node->indexes[0], &index_node->indexes[mid + 1],
-                            sizeof(split_node->indexes[0]) * (right_count + 1));
+    IndexNode* split_node = alloc<IndexNode>();
+    index_node->Rebuild(cells, 0, mid + 1);
+    split_node->Rebuild(cells, mid + 1, cells.size());
+    key.swap(cells[mid].first);
 
-    // Link old childs to new splited parent.
-    for (int i = mid + 1; i <= kOrder; ++i) {
-        off_t of_child = index_node->indexes[i].offset;
-        LeafNode* child_node = map<LeafNode>(of_child);
+    // 3. Link old childs to new splited parent.
+    for (size_t i = 0; i <= split_node->count; ++i) {
+        Node* child_node = map<Node>(split_node->Child(i));
         child_node->parent = split_node->offset;
         unmap(child_node);
     }
 
-    // Link siblings.
+    // 4. Link siblings.
     split_node->left = index_node->offset;
     split_node->right = index_node->right;
     index_node->right = split_node->offset;
@@ -765,11 +3574,11 @@ BPlusTree::IndexNode* BPlusTree::split_index_node(IndexNode* index_node) {
     return split_node;
 }
 
-inline int BPlusTree::get_index_from_leaf_node(LeafNode* leaf_node,
-                                            const char* key) const {
-    int index = lower_bound(leaf_node->records, leaf_node->count, key);
+inline int BPlusTree::get_index_from_leaf_node(const LeafNode* leaf_node,
+                                            std::string_view key) const {
+    int index = lower_bound(leaf_node, leaf_node->count, key);
     return index < static_cast<int>(leaf_node->count) &&
-                                 std::strncmp(leaf_node->Key(index), key, kMaxKeySize) == 0
+                                 leaf_node->KeyEquals(index, key)
                          ? index
                          : -1;
 }
@@ -777,94 +3586,306 @@ inline int BPlusTree::get_index_from_leaf_node(LeafNode* leaf_node,
 std::vector<std::pair<std::string, std::string>> BPlusTree::get_range(
         const std::string& left_key, const std::string& right_key) const {
     std::vector<std::pair<std::string, std::string>> res;
-    off_t of_leaf = get_leaf_offset(left_key.data());
-    LeafNode* leaf_node = map<LeafNode>(of_leaf);
-    int index = lower_bound(leaf_node->records, leaf_node->count, left_key.data());
-    for (int i = index; i < leaf_node->count; ++i) {
-        res.emplace_back(leaf_node->Key(i), leaf_node->Value(i));
-    }
-
-    of_leaf = leaf_node->right;
-    bool finish = false;
-    while (of_leaf != 0 && !finish) {
-        LeafNode* right_leaf_node = map<LeafNode>(of_leaf);
-        for (int i = 0; i < right_leaf_node->count; ++i) {
-            if (strncmp(right_leaf_node->Key(i), right_key.data(), kMaxKeySize) <=
-                    0) {
-                res.emplace_back(right_leaf_node->Key(i), right_leaf_node->Value(i));
+    for (Cursor cursor = scan(left_key, right_key); cursor.valid();
+             cursor.next()) {
+        res.emplace_back(cursor.key(), cursor.value());
+    }
+    return res;
+}
+
+BPlusTree::Cursor BPlusTree::scan(const std::string& left_key,
+                                                                    const std::string& right_key,
+                                                                    size_t limit, bool reverse) const {
+    return Cursor(this, left_key, right_key, limit, reverse, nullptr);
+}
+
+BPlusTree::Cursor BPlusTree::scan_prefix(const std::string& prefix,
+                                                                                 size_t limit, bool reverse) const {
+    return Cursor(this, prefix, prefix_end(prefix), limit, reverse, nullptr);
+}
+
+// No key with `prefix` sorts after prefix followed by kMaxKeySize 0xff.
+std::string BPlusTree::prefix_end(const std::string& prefix) {
+    return prefix + std::string(kMaxKeySize, '\xff');
+}
+
+BPlusTree::Cursor::Cursor(const BPlusTree* tree, const std::string& left_key,
+                                                    const std::string& right_key, size_t limit,
+                                                    bool reverse, const View* view)
+        : tree_(tree),
+            view_(view),
+            bound_(reverse ? left_key : right_key),
+            limit_(limit),
+            reverse_(reverse),
+            count_(0),
+            page_(new char[tree->page_size_]),
+            version_(0),
+            index_(0),
+            key_(reverse ? right_key : left_key),
+            valid_(false),
+            leaves_(0),
+            ahead_(0),
+            exhausted_(0) {
+    if (left_key.compare(right_key) > 0) return;
+    seek();
+    load();
+}
+
+std::string_view BPlusTree::Cursor::value() const {
+    const LeafNode* leaf_node = reinterpret_cast<const LeafNode*>(page_.get());
+    if (leaf_node->IsOverflow(index_)) return overflow_;
+    return leaf_node->Value(index_);
+}
+
+void BPlusTree::Cursor::next() {
+    if (!valid_) return;
+    index_ += reverse_ ? -1 : 1;
+    load();
+}
+
+// Copy leaf node of the first key not returned yet.
+void BPlusTree::Cursor::seek() {
+    const LeafNode* leaf_node = reinterpret_cast<const LeafNode*>(page_.get());
+    while (!tree_->read_leaf(key_, page_.get(), version_, view_)) {
+    }
+    ahead_ = 0;
+    exhausted_ = 0;
+    int n = leaf_node->count;
+    if (!reverse_) {
+        index_ = count_ == 0 ? tree_->lower_bound(leaf_node, n, key_)
+                                                 : tree_->upper_bound(leaf_node, n, key_);
+    } else {
+        index_ = (count_ == 0 ? tree_->upper_bound(leaf_node, n, key_)
+                                                    : tree_->lower_bound(leaf_node, n, key_)) -
+                         1;
+    }
+}
+
+// Move to the record at index_ or behind it. If a writer gets in the way,
+// seek again from the last key returned.
+void BPlusTree::Cursor::load() {
+    const LeafNode* leaf_node = reinterpret_cast<const LeafNode*>(page_.get());
+    valid_ = false;
+    if (count_ >= limit_) return;
+    while (true) {
+        // 1. Walk to sibling leaf nodes while this one is used up.
+        if (index_ < 0 || index_ >= static_cast<int>(leaf_node->count)) {
+            off_t of_sibling = reverse_ ? leaf_node->left : leaf_node->right;
+            if (of_sibling == 0) return;
+            if (tree_->read_node(of_sibling, leaf_node->offset, version_,
+                                                     page_.get(), version_, view_)) {
+                index_ = reverse_ ? static_cast<int>(leaf_node->count) - 1 : 0;
+                prefetch();
             } else {
-                finish = true;
-                break;
+                seek();
             }
+            continue;
+        }
+
+        // 2. Stop once the bound is passed.
+        scratch_.assign(leaf_node->Prefix());
+        scratch_.append(leaf_node->Suffix(index_));
+        int cmp = scratch_.compare(bound_);
+        if (reverse_ ? cmp < 0 : cmp > 0) return;
+        if (leaf_node->IsOverflow(index_) &&
+                !tree_->read_value(leaf_node, index_, version_, overflow_,
+                                                     view_)) {
+            seek();
+            continue;
         }
-        of_leaf = right_leaf_node->right;
-        unmap(right_leaf_node);
+        key_.swap(scratch_);
+        ++count_;
+        valid_ = true;
+        return;
     }
+}
 
-    unmap(leaf_node);
-    return res;
+// Ask for the leaf nodes the scan goes to next, so that a cold file is read
+// ahead instead of a fault at each leaf. The window doubles with each leaf
+// passed up to kMaxPrefetch, ends at the bound and at the limit, and is
+// topped up once half of it is used. Offsets are taken from the parent of
+// the current leaf, the next index node starts a new window.
+void BPlusTree::Cursor::prefetch() {
+    const LeafNode* leaf_node = reinterpret_cast<const LeafNode*>(page_.get());
+    ++leaves_;
+    if (ahead_ > 0) --ahead_;
+    size_t depth =
+            std::min(kMaxPrefetch, size_t(1) << std::min<size_t>(leaves_, 6));
+    if (leaf_node->count > 0) {
+        depth = std::min(depth, (limit_ - count_) / leaf_node->count + 1);
+    }
+    if (ahead_ * 2 > depth || leaf_node->parent == 0 ||
+            leaf_node->parent == exhausted_) {
+        return;
+    }
+
+    // 1. Copy the parent, it must still hold the leaf.
+    if (!parent_) parent_.reset(new char[tree_->page_size_]);
+    uint64_t version;
+    if (!tree_->read_node(leaf_node->parent, leaf_node->offset, version_,
+                                                parent_.get(), version, view_)) {
+        return;
+    }
+    const IndexNode* index_node = reinterpret_cast<const IndexNode*>(parent_.get());
+    const int n = index_node->count;
+    int i = 0;
+    while (i <= n && index_node->Child(i) != leaf_node->offset) ++i;
+    if (i > n) return;
+
+    // 2. Hint the children behind the ones hinted so far. Leaves which
+    // follow each other in the file, as after compact(), are left to the
+    // readahead of the OS.
+    std::vector<off_t> children;
+    bool sequential = true;
+    for (size_t k = ahead_ + 1; k <= depth; ++k) {
+        int child = reverse_ ? i - static_cast<int>(k) : i + static_cast<int>(k);
+        // Child covers keys from the separator before it up to the one behind.
+        if (child < 0 || child > n ||
+                (reverse_ ? index_node->Key(child).compare(bound_) <= 0
+                                    : child > 0 && index_node->Key(child - 1).compare(bound_) > 0)) {
+            exhausted_ = leaf_node->parent;
+            break;
+        }
+        off_t of_child = index_node->Child(child);
+        off_t distance = static_cast<off_t>(k * tree_->page_size_);
+        sequential = sequential && of_child == (reverse_ ? leaf_node->offset - distance
+                                                         : leaf_node->offset + distance);
+        children.push_back(of_child);
+        ahead_ = k;
+    }
+    if (!sequential) tree_->block_cache_->Prefetch(children, view_);
+}
+
+bool BPlusTree::empty() const { return size() == 0; }
+
+size_t BPlusTree::size() const { return size(nullptr); }
+
+size_t BPlusTree::size(const View* view) const {
+    if (view != nullptr) {
+        return reinterpret_cast<const Meta*>(
+                block_cache_->Read(kMetaOffset, *view))->size;
+    }
+    while (true) {
+        uint64_t version = block_cache_->StableVersion(kMetaOffset);
+        size_t size =
+                reinterpret_cast<const Meta*>(block_cache_->Read(kMetaOffset))->size;
+        if (block_cache_->Validate(kMetaOffset, version)) return size;
+    }
+}
+
+BPlusTree::Snapshot BPlusTree::snapshot() const {
+    if (!block_cache_->Shadow()) {
+        throw std::logic_error("snapshots need shadow mode");
+    }
+    return Snapshot(this, block_cache_->OpenView());
 }
 
-bool BPlusTree::empty() const { return meta_->size == 0; }
+BPlusTree::Snapshot::Snapshot(const BPlusTree* tree, View* view)
+        : tree_(tree), view_(view) {}
 
-size_t BPlusTree::size() const { return meta_->size; }
+BPlusTree::Snapshot::Snapshot(Snapshot&& other) noexcept
+        : tree_(other.tree_), view_(other.view_) {
+    other.view_ = nullptr;
+}
+
+BPlusTree::Snapshot::~Snapshot() {
+    if (view_ != nullptr) tree_->block_cache_->CloseView(view_);
+}
+
+bool BPlusTree::Snapshot::get(const std::string& key,
+                                                            std::string& value) const {
+    return tree_->get(key, value, view_);
+}
+
+BPlusTree::Cursor BPlusTree::Snapshot::scan(const std::string& left_key,
+                                                                                        const std::string& right_key,
+                                                                                        size_t limit, bool reverse) const {
+    return Cursor(tree_, left_key, right_key, limit, reverse, view_);
+}
+
+BPlusTree::Cursor BPlusTree::Snapshot::scan_prefix(const std::string& prefix,
+                                                                                                     size_t limit,
+                                                                                                     bool reverse) const {
+    return Cursor(tree_, prefix, prefix_end(prefix), limit, reverse, view_);
+}
+
+bool BPlusTree::Snapshot::get_postings(const std::string& key,
+                                                                         std::vector<uint64_t>& postings) const {
+    return tree_->get_postings(key, postings, view_);
+}
+
+size_t BPlusTree::Snapshot::size() const { return tree_->size(view_); }
 
-// Try Borrow key from left sibling.
+// Try Borrow records from left sibling.
 bool BPlusTree::borrow_from_left_leaf_sibling(LeafNode* leaf_node) {
     if (leaf_node->left == 0) return false;
     LeafNode* sibling = map<LeafNode>(leaf_node->left);
-    if (sibling->parent != leaf_node->parent || sibling->count <= get_min_keys()) {
-        if (sibling->parent == leaf_node->parent) {
-            assert(sibling->count == get_min_keys());
-        }
+    if (sibling->parent != leaf_node->parent) {
         unmap(sibling);
         return false;
     }
-    // 1. Borrow last key from left sibling.
-    leaf_node->InsertKVAtIndex(0, sibling->LastKey(), sibling->LastValue());
-    --sibling->count;
 
-    // 2. Update parent's key.
+    // 1. Borrow last records from left sibling as long as sibling stays
+    // filled enough and parent has room for the new key.
     IndexNode* parent_node = map<IndexNode>(leaf_node->parent);
-    int index =
-            upper_bound(parent_node->indexes, parent_node->count, sibling->LastKey());
-    parent_node->UpdateKey(index, leaf_node->FirstKey());
+    int index = parent_node->ChildIndex(sibling->offset);
+    std::string separator;
+    while (leaf_node->Underflow() && sibling->count > 1) {
+        int last = sibling->count - 1;
+        std::string record = sibling->Record(last);
+        std::string key =
+                ShortestSeparator(sibling->Key(last - 1), sibling->Key(last));
+        if (!sibling->CanLend(last) || !leaf_node->CanInsertRecord(record) ||
+                !parent_node->CanUpdateKey(index, key)) {
+            break;
+        }
+        leaf_node->InsertRecordAtIndex(0, record);
+        sibling->DeleteKVAtIndex(last);
+        separator.swap(key);
+    }
+
+    // 2. Update parent's key.
+    bool borrowed = !separator.empty();
+    if (borrowed) parent_node->UpdateKey(index, separator);
     unmap<IndexNode>(parent_node);
     unmap<LeafNode>(sibling);
-    return true;
+    return borrowed;
 }
 
-// Try Borrow key from right sibling.
+// Try Borrow records from right sibling.
 bool BPlusTree::borrow_from_right_leaf_sibling(LeafNode* leaf_node) {
     if (leaf_node->right == 0) return false;
     LeafNode* sibling = map<LeafNode>(leaf_node->right);
-
-    if (sibling->parent != leaf_node->parent || sibling->count <= get_min_keys()) {
-        if (sibling->parent == leaf_node->parent) {
-            assert(sibling->count == get_min_keys());
-        }
+    if (sibling->parent != leaf_node->parent) {
         unmap(sibling);
         return false;
     }
 
-    // 1. Borrow frist key from right sibling.
-    leaf_node->UpdateKV(leaf_node->count++, sibling->FirstKey(),
-                                            sibling->FirstValue());
-    sibling->DeleteKVAtIndex(0);
-
-    // 2. Update parent's key.
+    // 1. Borrow frist records from right sibling.
     IndexNode* parent_node = map<IndexNode>(leaf_node->parent);
-    int index =
-            upper_bound(parent_node->indexes, parent_node->count, sibling->LastKey());
-    parent_node->UpdateKey(index - 1, sibling->FirstKey());
+    int index = parent_node->ChildIndex(leaf_node->offset);
+    std::string separator;
+    while (leaf_node->Underflow() && sibling->count > 1) {
+        std::string record = sibling->Record(0);
+        std::string key = ShortestSeparator(sibling->Key(0), sibling->Key(1));
+        if (!sibling->CanLend(0) || !leaf_node->CanInsertRecord(record) ||
+                !parent_node->CanUpdateKey(index, key)) {
+            break;
+        }
+        leaf_node->AppendRecord(record);
+        sibling->DeleteKVAtIndex(0);
+        separator.swap(key);
+    }
 
+    // 2. Update parent's key.
+    bool borrowed = !separator.empty();
+    if (borrowed) parent_node->UpdateKey(index, separator);
     unmap<IndexNode>(parent_node);
     unmap<LeafNode>(sibling);
-    return true;
+    return borrowed;
 }
 
 inline bool BPlusTree::borrow_from_leaf_sibling(LeafNode* leaf_node) {
-    assert(leaf_node->count == get_min_keys() - 1);
     assert(leaf_node->parent != 0);
     return borrow_from_left_leaf_sibling(leaf_node) ||
                  borrow_from_right_leaf_sibling(leaf_node);
@@ -878,16 +3899,19 @@ bool BPlusTree::merge_left_leaf(LeafNode* leaf_node) {
         unmap(sibling);
         return false;
     }
+    LeafNode::Records records = LeafNode::Concat(sibling, leaf_node);
+    if (LeafNode::PackedSize(records, 0, records.size()) > leaf_node->Capacity()) {
+        unmap(sibling);
+        return false;
+    }
 
-    assert(sibling->count == get_min_keys());
     // 1. remove key from parent.
     IndexNode* parent_node = map<IndexNode>(leaf_node->parent);
-    int index =
-            upper_bound(parent_node->indexes, parent_node->count, sibling->LastKey());
+    int index = parent_node->ChildIndex(sibling->offset);
     parent_node->DeleteKeyAtIndex(index);
 
     // 2. Merge left sibling.
-    leaf_node->MergeLeftSibling(sibling);
+    leaf_node->Rebuild(records, 0, records.size());
 
     // 3. Link new sibling.
     leaf_node->left = sibling->left;
@@ -910,17 +3934,21 @@ bool BPlusTree::merge_right_leaf(LeafNode* leaf_node) {
         unmap(sibling);
         return false;
     }
+    LeafNode::Records records = LeafNode::Concat(leaf_node, sibling);
+    if (LeafNode::PackedSize(records, 0, records.size()) > leaf_node->Capacity()) {
+        unmap(sibling);
+        return false;
+    }
 
     // 1. remove key from parent.
     IndexNode* parent_node = map<IndexNode>(leaf_node->parent);
-    int index =
-            upper_bound(parent_node->indexes, parent_node->count, sibling->LastKey());
-    parent_node->UpdateKey(index - 1, parent_node->Key(index));
+    int index = parent_node->ChildIndex(leaf_node->offset);
+    parent_node->UpdateOffset(index + 1, leaf_node->offset);
     parent_node->DeleteKeyAtIndex(index);
     unmap(parent_node);
 
     // 2. Merge right sibling.
-    leaf_node->MergeRightSibling(sibling);
+    leaf_node->Rebuild(records, 0, records.size());
 
     // 3. Link new sibling.
     leaf_node->right = sibling->right;
@@ -934,41 +3962,43 @@ bool BPlusTree::merge_right_leaf(LeafNode* leaf_node) {
     return true;
 }
 
-inline BPlusTree::LeafNode* BPlusTree::merge_leaf(LeafNode* leaf_node) {
+inline bool BPlusTree::merge_leaf(LeafNode* leaf_node) {
     // Merge left node to leaf_node or right node to leaf_node.
-    assert(leaf_node->count == get_min_keys() - 1);
     assert(leaf_node->parent != 0);
     assert(meta_->root != leaf_node->offset);
-    assert(merge_left_leaf(leaf_node) || merge_right_leaf(leaf_node));
-    return leaf_node;
+    return merge_left_leaf(leaf_node) || merge_right_leaf(leaf_node);
 }
 
 // Try Swap key between index_node's left sibling and index_node's parent.
 bool BPlusTree::borrow_from_left_index_sibling(IndexNode* index_node) {
     if (index_node->left == 0) return false;
     IndexNode* sibling = map<IndexNode>(index_node->left);
-    if (sibling->parent != index_node->parent || sibling->count <= get_min_keys()) {
-        if (sibling->parent == index_node->parent) {
-            assert(sibling->count == get_min_keys());
-        }
+    if (sibling->parent != index_node->parent || sibling->count == 0 ||
+            !sibling->CanLend(sibling->count - 1)) {
         unmap(sibling);
         return false;
     }
 
-    // 1.Insert parent'key to the first of index_node's keys.
     IndexNode* parent_node = map<IndexNode>(index_node->parent);
-    int index =
-            upper_bound(parent_node->indexes, parent_node->count, sibling->LastKey());
-    index_node->InsertKeyAtIndex(0, parent_node->Key(index));
+    int index = parent_node->ChildIndex(sibling->offset);
+    if (!index_node->CanInsertKey(parent_node->Key(index)) ||
+            !parent_node->CanUpdateKey(index, sibling->LastKey())) {
+        unmap(parent_node);
+        unmap(sibling);
+        return false;
+    }
+
+    // 1.Insert parent'key to the first of index_node's keys, and link
+    // sibling's last child to index_node.
+    off_t of_last_child = sibling->Child(sibling->count);
+    index_node->InsertIndexAtIndex(0, parent_node->Key(index), of_last_child);
 
     // 2. Change parent's key.
     parent_node->UpdateKey(index, sibling->LastKey());
 
-    // 3. Link sibling's last child to index_node,
-    // and delete sibling's last child.
-    Node* last_sibling_child =
-            map<Node>(sibling->indexes[sibling->count--].offset);
-    index_node->indexes[0].offset = last_sibling_child->offset;
+    // 3. Delete sibling's last key and child.
+    sibling->DeleteLastIndex();
+    Node* last_sibling_child = map<Node>(of_last_child);
     last_sibling_child->parent = index_node->offset;
 
     unmap(last_sibling_child);
@@ -980,28 +4010,35 @@ bool BPlusTree::borrow_from_left_index_sibling(IndexNode* index_node) {
 bool BPlusTree::borrow_from_right_index_sibling(IndexNode* index_node) {
     if (index_node->right == 0) return false;
     IndexNode* sibling = map<IndexNode>(index_node->right);
-    if (sibling->parent != index_node->parent || sibling->count <= get_min_keys()) {
-        if (sibling->parent == index_node->parent) {
-            assert(sibling->count == get_min_keys());
-        }
+    if (sibling->parent != index_node->parent || sibling->count == 0 ||
+            !sibling->CanLend(0)) {
         unmap(sibling);
         return false;
     }
 
-    // 1.Insert parent‘key to the last of index_node's keys.
     IndexNode* parent = map<IndexNode>(index_node->parent);
-    int index = upper_bound(parent->indexes, parent->count, sibling->LastKey());
-    index_node->UpdateKey(index_node->count++, parent->Key(index - 1));
+    int index = parent->ChildIndex(index_node->offset);
+    if (!index_node->CanInsertKey(parent->Key(index)) ||
+            !parent->CanUpdateKey(index, sibling->FirstKey())) {
+        unmap(parent);
+        unmap(sibling);
+        return false;
+    }
+
+    // 1.Insert parent‘key to the last of index_node's keys, and link
+    // sibling's first child to index_node.
+    off_t of_first_child = sibling->Child(0);
+    index_node->InsertIndexAtIndex(index_node->count, parent->Key(index),
+                                                                 index_node->Child(index_node->count));
+    index_node->UpdateOffset(index_node->count, of_first_child);
 
     // 2. Change parent's key.
-    parent->UpdateKey(index - 1, sibling->FirstKey());
+    parent->UpdateKey(index, sibling->FirstKey());
 
-    // 3. Link index_node's last child to sibling's first child,
-    // and delete sibling's first child.
-    Node* first_sibling_child = map<Node>(sibling->indexes[0].offset);
-    index_node->indexes[index_node->count].offset = first_sibling_child->offset;
-    first_sibling_child->parent = index_node->offset;
+    // 3. Delete sibling's first key and child.
     sibling->DeleteKeyAtIndex(0);
+    Node* first_sibling_child = map<Node>(of_first_child);
+    first_sibling_child->parent = index_node->offset;
 
     unmap(first_sibling_child);
     unmap(parent);
@@ -1010,7 +4047,6 @@ bool BPlusTree::borrow_from_right_index_sibling(IndexNode* index_node) {
 }
 
 inline bool BPlusTree::borrow_from_index_sibling(IndexNode* index_node) {
-    assert(index_node->count == get_min_keys() - 1);
     return borrow_from_left_index_sibling(index_node) ||
                  borrow_from_right_index_sibling(index_node);
 }
@@ -1024,13 +4060,22 @@ bool BPlusTree::merge_left_index(IndexNode* index_node) {
         return false;
     }
 
-    assert(sibling->count == get_min_keys());
-    // 1. Merge left sibling to index_node.
-    index_node->MergeLeftSibling(sibling);
+    IndexNode* parent_node = map<IndexNode>(index_node->parent);
+    int index = parent_node->ChildIndex(sibling->offset);
+    IndexNode::Cells cells =
+            IndexNode::Concat(sibling, parent_node->Key(index), index_node);
+    if (IndexNode::PackedSize(cells, 0, cells.size()) > index_node->Capacity()) {
+        unmap(parent_node);
+        unmap(sibling);
+        return false;
+    }
+
+    // 1. Merge left sibling to index_node, parent's key goes between them.
+    index_node->Rebuild(cells, 0, cells.size());
 
     // 2. Link sibling's childs to index_node.
     for (size_t i = 0; i < sibling->count + 1; ++i) {
-        Node* child_node = map<Node>(sibling->indexes[i].offset);
+        Node* child_node = map<Node>(sibling->Child(i));
         child_node->parent = index_node->offset;
         unmap(child_node);
     }
@@ -1043,15 +4088,10 @@ bool BPlusTree::merge_left_index(IndexNode* index_node) {
         unmap(new_sibling);
     }
 
-    // 4. Update index_node's mid key.
-    IndexNode* parent_node = map<IndexNode>(index_node->parent);
-    int index =
-            upper_bound(parent_node->indexes, parent_node->count, sibling->LastKey());
-    index_node->UpdateKey(sibling->count, parent_node->Key(index));
-
-    // 5. remove parent's key.
+    // 4. remove parent's key.
     parent_node->DeleteKeyAtIndex(index);
 
+    unmap(parent_node);
     dealloc(sibling);
     return true;
 }
@@ -1065,23 +4105,27 @@ bool BPlusTree::merge_right_index(IndexNode* index_node) {
         return false;
     }
 
-    assert(sibling->count == get_min_keys());
-    // 1. Update index_node's last key.
     IndexNode* parent = map<IndexNode>(index_node->parent);
-    int index = upper_bound(parent->indexes, parent->count, sibling->LastKey());
-    index_node->UpdateKey(index_node->count++, parent->Key(index - 1));
+    int index = parent->ChildIndex(index_node->offset);
+    IndexNode::Cells cells =
+            IndexNode::Concat(index_node, parent->Key(index), sibling);
+    if (IndexNode::PackedSize(cells, 0, cells.size()) > index_node->Capacity()) {
+        unmap(parent);
+        unmap(sibling);
+        return false;
+    }
 
-    // 2. Merge right sibling to index_node.
-    index_node->MergeRightSibling(sibling);
+    // 1. Merge right sibling to index_node, parent's key goes between them.
+    index_node->Rebuild(cells, 0, cells.size());
 
-    // 3. Link sibling's childs to index_node.
+    // 2. Link sibling's childs to index_node.
     for (size_t i = 0; i < sibling->count + 1; ++i) {
-        Node* child_node = map<Node>(sibling->indexes[i].offset);
+        Node* child_node = map<Node>(sibling->Child(i));
         child_node->parent = index_node->offset;
         unmap(child_node);
     }
 
-    // 4. Link new sibling.
+    // 3. Link new sibling.
     index_node->right = sibling->right;
     if (sibling->right != 0) {
         IndexNode* new_sibling = map<IndexNode>(sibling->right);
@@ -1089,27 +4133,27 @@ bool BPlusTree::merge_right_index(IndexNode* index_node) {
         unmap(new_sibling);
     }
 
-    // 5. remove parent's key.
-    parent->UpdateKey(index - 1, parent->Key(index));
+    // 4. remove parent's key.
+    parent->UpdateOffset(index + 1, index_node->offset);
     parent->DeleteKeyAtIndex(index);
 
+    unmap(parent);
     dealloc(sibling);
     return true;
 }
 
-inline BPlusTree::IndexNode* BPlusTree::merge_index(IndexNode* index_node) {
-    assert(index_node->count == get_min_keys() - 1);
+inline bool BPlusTree::merge_index(IndexNode* index_node) {
     assert(index_node->parent != 0);
     assert(meta_->root != index_node->offset);
-    assert(merge_left_index(index_node) || merge_right_index(index_node));
-    return index_node;
+    return merge_left_index(index_node) || merge_right_index(index_node);
 }
 
 #ifdef DEBUG
 #include <queue>
 void BPlusTree::dump() {
+    WriteGuard guard(this);
     std::vector<std::vector<std::vector<std::string>>> res(
-            5, std::vector<std::vector<std::string>>());
+            meta_->height + 1, std::vector<std::vector<std::string>>());
     std::queue<std::pair<off_t, int>> q;
     q.emplace(meta_->root, 1);
     while (!q.empty()) {
@@ -1119,14 +4163,8 @@ void BPlusTree::dump() {
             IndexNode* index_node = map<IndexNode>(cur.first);
             std::vector<std::string> v;
             for (int i = 0; i < index_node->count + 1; ++i) {
-                if (i == index_node->count) {
-                    v.push_back("");
-                } else {
-                    v.push_back(index_node->indexes[i].key);
-                }
-                if (index_node->indexes[i].offset != 0) {
-                    q.emplace(index_node->indexes[i].offset, cur.second + 1);
-                }
+                v.emplace_back(index_node->Key(i));
+                q.emplace(index_node->Child(i), cur.second + 1);
             }
             res[cur.second].push_back(v);
             unmap(index_node);
@@ -1134,7 +4172,7 @@ void BPlusTree::dump() {
             LeafNode* leaf_node = map<LeafNode>(cur.first);
             std::vector<std::string> v;
             for (int i = 0; i < leaf_node->count; ++i) {
-                v.push_back(leaf_node->records[i].key);
+                v.emplace_back(leaf_node->Key(i));
             }
             res[cur.second].push_back(v);
             unmap(leaf_node);
@@ -1154,4 +4192,4 @@ void BPlusTree::dump() {
         LOG2("%s", "\n");
     }
 }
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,143 @@
+#include <tree_builder/parse_engine.hpp>
+
+#include <algorithm>
+
+// Number of languages in enum Language.
+static const size_t kLanguages = TREE_BUILDER_LANGUAGE_TYPESCRIPT + 1;
+
+ParseEngine::ParseEngine(size_t threads, Callback callback, size_t max_results)
+    : callback_(std::move(callback)),
+      max_results_(max_results),
+      next_queue_(0),
+      queued_(0),
+      outstanding_(0),
+      closed_(false),
+      stopping_(false) {
+    if (threads == 0) {
+        threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    if (max_results_ == 0) {
+        max_results_ = threads * 4;
+    }
+    for (size_t i = 0; i < threads; i++) {
+        queues_.emplace_back(new Queue());
+    }
+    for (size_t i = 0; i < threads; i++) {
+        threads_.emplace_back(&ParseEngine::work, this, i);
+    }
+}
+
+ParseEngine::~ParseEngine() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+        stopping_ = true;
+    }
+    work_cv_.notify_all();
+    space_cv_.notify_all();
+    for (std::thread &thread : threads_) {
+        thread.join();
+    }
+}
+
+void ParseEngine::submit(std::string path, Language language) {
+    if (static_cast<size_t>(language) >= kLanguages) {
+        throw std::invalid_argument("unknown language");
+    }
+    Queue &queue = *queues_[next_queue_++ % queues_.size()];
+    {
+        // Counted under mutex_ so a worker about to sleep sees it.
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (closed_) {
+            throw std::logic_error("submit to a closed parse engine");
+        }
+        std::lock_guard<std::mutex> queue_lock(queue.mutex);
+        queue.jobs.push_back(Job{std::move(path), language});
+        outstanding_++;
+        queued_++;
+    }
+    work_cv_.notify_one();
+}
+
+void ParseEngine::close() {
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = true;
+    }
+    result_cv_.notify_all();
+}
+
+bool ParseEngine::next(ParseResult &result) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    result_cv_.wait(lock, [this] {
+        return !results_.empty() || (closed_ && outstanding_ == 0);
+    });
+    if (results_.empty()) return false;
+    result = std::move(results_.front());
+    results_.pop_front();
+    outstanding_--;
+    // Other callers waiting for a result would never get one.
+    bool drained = closed_ && outstanding_ == 0;
+    lock.unlock();
+    space_cv_.notify_one();
+    if (drained) result_cv_.notify_all();
+    return true;
+}
+
+// Own queue from the front, others from the back.
+bool ParseEngine::take(size_t index, Job &job) {
+    for (size_t i = 0; i < queues_.size(); i++) {
+        Queue &queue = *queues_[(index + i) % queues_.size()];
+        std::lock_guard<std::mutex> lock(queue.mutex);
+        if (queue.jobs.empty()) continue;
+        if (i == 0) {
+            job = std::move(queue.jobs.front());
+            queue.jobs.pop_front();
+        } else {
+            job = std::move(queue.jobs.back());
+            queue.jobs.pop_back();
+        }
+        queued_--;
+        return true;
+    }
+    return false;
+}
+
+void ParseEngine::work(size_t index) {
+    // A parser per language, made the first time this worker needs it.
+    std::unique_ptr<TreeBuilder> builders[kLanguages];
+
+    for (;;) {
+        Job job;
+        if (!take(index, job)) {
+            std::unique_lock<std::mutex> lock(mutex_);
+            work_cv_.wait(lock, [this] { return queued_ > 0 || stopping_; });
+            if (stopping_) return;
+            continue;
+        }
+
+        ParseResult result;
+        result.path = std::move(job.path);
+        result.language = job.language;
+        try {
+            std::unique_ptr<TreeBuilder> &builder = builders[job.language];
+            if (!builder) builder.reset(new TreeBuilder(job.language));
+            result.source.reset(new SourceFile(result.path.c_str()));
+            result.tree.reset(builder->build_tree(*result.source));
+            if (!result.tree) {
+                throw std::runtime_error("fail to parse " + result.path);
+            }
+            if (callback_) callback_(*builder, result);
+        } catch (const std::exception &e) {
+            result.tree.reset();
+            result.error = e.what();
+        }
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        space_cv_.wait(lock, [this] { return results_.size() < max_results_ || stopping_; });
+        if (stopping_) return;
+        results_.push_back(std::move(result));
+        lock.unlock();
+        result_cv_.notify_one();
+    }
+}
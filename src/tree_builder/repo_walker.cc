@@ -0,0 +1,398 @@
+#include <tree_builder/repo_walker.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <condition_variable>
+#include <cstring>
+#include <exception>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+namespace fs = std::filesystem;
+
+// Bytes read from the start of a file to look for a shebang or a NUL.
+static const size_t kSniffSize = 512;
+
+static const struct {
+    const char *extension;
+    Language language;
+} kExtensions[] = {
+    {"go", TREE_BUILDER_LANGUAGE_GOLANG},
+    {"java", TREE_BUILDER_LANGUAGE_JAVA},
+    {"py", TREE_BUILDER_LANGUAGE_PYTHON},
+    {"pyi", TREE_BUILDER_LANGUAGE_PYTHON},
+    {"pyw", TREE_BUILDER_LANGUAGE_PYTHON},
+    {"js", TREE_BUILDER_LANGUAGE_JAVASCRIPT},
+    {"jsx", TREE_BUILDER_LANGUAGE_JAVASCRIPT},
+    {"mjs", TREE_BUILDER_LANGUAGE_JAVASCRIPT},
+    {"cjs", TREE_BUILDER_LANGUAGE_JAVASCRIPT},
+    {"ts", TREE_BUILDER_LANGUAGE_TYPESCRIPT},
+    {"tsx", TREE_BUILDER_LANGUAGE_TYPESCRIPT},
+    {"mts", TREE_BUILDER_LANGUAGE_TYPESCRIPT},
+    {"cts", TREE_BUILDER_LANGUAGE_TYPESCRIPT},
+};
+
+bool detect_language(const std::string &path, Language &language) {
+    size_t dot = path.find_last_of("./\\");
+    if (dot == std::string::npos || path[dot] != '.') return false;
+    std::string extension = path.substr(dot + 1);
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    for (const auto &entry : kExtensions) {
+        if (extension == entry.extension) {
+            language = entry.language;
+            return true;
+        }
+    }
+    return false;
+}
+
+// fnmatch() with FNM_PATHNAME, plus "**" which also matches across
+// directories, as .gitignore uses it.
+static bool glob_match(const char *p, const char *s) {
+    while (*p) {
+        switch (*p) {
+            case '*':
+                if (p[1] == '*') {
+                    p += 2;
+                    if (*p == '/') {
+                        // "**/" matches no directory or any number of them.
+                        p++;
+                        for (;;) {
+                            if (glob_match(p, s)) return true;
+                            const char *slash = strchr(s, '/');
+                            if (slash == NULL) return false;
+                            s = slash + 1;
+                        }
+                    }
+                    for (;; s++) {
+                        if (glob_match(p, s)) return true;
+                        if (!*s) return false;
+                    }
+                }
+                p++;
+                for (;; s++) {
+                    if (glob_match(p, s)) return true;
+                    if (!*s || *s == '/') return false;
+                }
+            case '?':
+                if (!*s || *s == '/') return false;
+                p++;
+                s++;
+                break;
+            case '[': {
+                if (!*s || *s == '/') return false;
+                const char *q = p + 1;
+                bool negate = *q == '!' || *q == '^';
+                if (negate) q++;
+                bool found = false;
+                unsigned char c = *s;
+                // A ']' right after the '[' is taken literally.
+                do {
+                    if (*q == '\\' && q[1]) q++;
+                    unsigned char lo = *q, hi = lo;
+                    if (q[1] == '-' && q[2] && q[2] != ']') {
+                        hi = q[2];
+                        q += 2;
+                    }
+                    if (c >= lo && c <= hi) found = true;
+                    q++;
+                } while (*q && *q != ']');
+                if (!*q) {
+                    // No closing bracket, a plain '['.
+                    if (*s != '[') return false;
+                    p++;
+                    s++;
+                    break;
+                }
+                if (found == negate) return false;
+                p = q + 1;
+                s++;
+                break;
+            }
+            case '\\':
+                if (p[1]) p++;
+                // fall through
+            default:
+                if (*p != *s) return false;
+                p++;
+                s++;
+        }
+    }
+    return !*s;
+}
+
+namespace {
+
+struct IgnoreRule {
+    std::string pattern;
+    bool negate;
+    bool dir_only;
+    // Matched against the path below the .gitignore, not just the name.
+    bool anchored;
+};
+
+// Rules of one .gitignore, chained to those of the directories above.
+struct IgnoreList {
+    // Directory of the .gitignore relative to the root, "" or ending in '/'.
+    std::string base;
+    std::vector<IgnoreRule> rules;
+    std::shared_ptr<const IgnoreList> parent;
+};
+
+}  // namespace
+
+static void add_rule(IgnoreList &list, std::string line) {
+    if (!line.empty() && line.back() == '\r') line.pop_back();
+    while (!line.empty() && line.back() == ' ' &&
+           !(line.size() > 1 && line[line.size() - 2] == '\\')) {
+        line.pop_back();
+    }
+    if (line.empty() || line[0] == '#') return;
+
+    IgnoreRule rule;
+    rule.negate = false;
+    rule.dir_only = false;
+    if (line[0] == '!') {
+        rule.negate = true;
+        line.erase(0, 1);
+    } else if (line[0] == '\\' && (line[1] == '#' || line[1] == '!')) {
+        line.erase(0, 1);
+    }
+    if (!line.empty() && line.back() == '/') {
+        rule.dir_only = true;
+        line.pop_back();
+    }
+    if (line.empty()) return;
+    rule.anchored = line.find('/') != std::string::npos;
+    if (line[0] == '/') line.erase(0, 1);
+    rule.pattern = std::move(line);
+    list.rules.push_back(std::move(rule));
+}
+
+// Whether path, relative to the root, is ignored. The deepest .gitignore
+// decides, and within it the last line which matches.
+static bool ignored(const IgnoreList *list, const std::string &path, size_t name_pos,
+                    bool is_dir) {
+    for (; list != NULL; list = list->parent.get()) {
+        const char *below = path.c_str() + list->base.size();
+        const char *name = path.c_str() + name_pos;
+        for (auto rule = list->rules.rbegin(); rule != list->rules.rend(); ++rule) {
+            if (rule->dir_only && !is_dir) continue;
+            if (glob_match(rule->pattern.c_str(), rule->anchored ? below : name)) {
+                return !rule->negate;
+            }
+        }
+    }
+    return false;
+}
+
+namespace {
+
+// State shared by the threads of one walk().
+struct Walk {
+    struct Dir {
+        // Relative to the root, "" or ending in '/'.
+        std::string path;
+        std::shared_ptr<const IgnoreList> ignores;
+    };
+
+    const RepoWalker::Options &options;
+    const RepoWalker::BatchCallback &emit;
+    std::string root;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Dir> pending;
+    size_t active;
+    std::exception_ptr error;
+
+    std::mutex emit_mutex;
+    std::atomic<size_t> found;
+
+    Walk(const RepoWalker::Options &options, const RepoWalker::BatchCallback &emit,
+         const std::string &root)
+        : options(options), emit(emit), root(root), active(0), found(0) {
+        if (!this->root.empty() && this->root.back() != '/') this->root += '/';
+    }
+
+    void run() {
+        std::vector<WalkItem> batch;
+        try {
+            for (;;) {
+                Dir dir;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    cv.wait(lock, [this] { return !pending.empty() || active == 0 || error; });
+                    if (pending.empty() || error) break;
+                    dir = std::move(pending.back());
+                    pending.pop_back();
+                    active++;
+                }
+                read_dir(dir, batch);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    active--;
+                    if (active == 0 && pending.empty()) cv.notify_all();
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (error) return;
+            }
+            flush(batch);
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!error) error = std::current_exception();
+            cv.notify_all();
+        }
+    }
+
+    void read_dir(const Dir &dir, std::vector<WalkItem> &batch) {
+        struct Entry {
+            std::string name;
+            bool is_dir;
+            fs::directory_entry entry;
+        };
+        std::vector<Entry> entries;
+        bool has_gitignore = false;
+
+        // Types come from the directory listing. Only files which pass the
+        // filters below are looked at more closely: their size is taken from
+        // the listing where the platform keeps it (a stat() elsewhere), and
+        // they are opened to be sniffed.
+        std::error_code ec;
+        fs::directory_iterator it(root + dir.path, fs::directory_options::skip_permission_denied,
+                                  ec);
+        for (fs::directory_iterator end; !ec && it != end; it.increment(ec)) {
+            std::error_code type_ec;
+            if (it->is_symlink(type_ec)) continue;
+            bool is_dir = it->is_directory(type_ec);
+            if (!is_dir && !it->is_regular_file(type_ec)) continue;
+            std::string name = it->path().filename().string();
+            if (!is_dir && name == ".gitignore") has_gitignore = true;
+            entries.push_back(Entry{std::move(name), is_dir, *it});
+        }
+
+        std::shared_ptr<const IgnoreList> ignores = dir.ignores;
+        if (has_gitignore && options.use_gitignore) {
+            std::shared_ptr<IgnoreList> list = std::make_shared<IgnoreList>();
+            list->base = dir.path;
+            list->parent = dir.ignores;
+            std::ifstream file(root + dir.path + ".gitignore");
+            std::string line;
+            while (std::getline(file, line)) add_rule(*list, std::move(line));
+            ignores = list;
+        }
+
+        std::vector<Dir> subdirs;
+        for (Entry &entry : entries) {
+            std::string path = dir.path + entry.name;
+            if (entry.is_dir) {
+                if (std::find(options.skip_dirs.begin(), options.skip_dirs.end(), entry.name) !=
+                    options.skip_dirs.end()) {
+                    continue;
+                }
+                if (ignored(ignores.get(), path, dir.path.size(), true)) continue;
+                subdirs.push_back(Dir{path + '/', ignores});
+                continue;
+            }
+
+            WalkItem item;
+            bool known = detect_language(entry.name, item.language);
+            // Scripts without an extension may still say what they are.
+            bool shebang = !known && entry.name.find('.') == std::string::npos;
+            if (!known && !shebang) continue;
+            if (ignored(ignores.get(), path, dir.path.size(), false)) continue;
+
+            item.path = root + path;
+            item.size = entry.entry.file_size(ec);
+            if (ec || item.size > options.max_file_size) continue;
+            if ((options.skip_binary || shebang) && !sniff(item, shebang)) continue;
+
+            batch.push_back(std::move(item));
+            if (batch.size() >= options.batch_size) flush(batch);
+        }
+
+        if (!subdirs.empty()) {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (Dir &subdir : subdirs) pending.push_back(std::move(subdir));
+            cv.notify_all();
+        }
+    }
+
+    // Looks at the start of the file, false when it is binary or, for a file
+    // without an extension, not a script we parse.
+    bool sniff(WalkItem &item, bool shebang) {
+        char head[kSniffSize];
+        std::ifstream file(item.path, std::ios::binary);
+        file.read(head, sizeof(head));
+        size_t n = static_cast<size_t>(file.gcount());
+        if (memchr(head, '\0', n) != NULL) return false;
+        if (!shebang) return true;
+
+        if (n < 2 || head[0] != '#' || head[1] != '!') return false;
+        std::string line(head, std::find(head, head + n, '\n'));
+        if (line.find("python") != std::string::npos) {
+            item.language = TREE_BUILDER_LANGUAGE_PYTHON;
+            return true;
+        }
+        if (line.find("node") != std::string::npos) {
+            item.language = TREE_BUILDER_LANGUAGE_JAVASCRIPT;
+            return true;
+        }
+        return false;
+    }
+
+    void flush(std::vector<WalkItem> &batch) {
+        if (batch.empty()) return;
+        found += batch.size();
+        {
+            std::lock_guard<std::mutex> lock(emit_mutex);
+            emit(batch);
+        }
+        batch.clear();
+    }
+};
+
+}  // namespace
+
+RepoWalker::RepoWalker(const Options &options) : options_(options) {
+    if (options_.threads == 0) {
+        options_.threads = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+    }
+    if (options_.batch_size == 0) {
+        options_.batch_size = 1;
+    }
+}
+
+size_t RepoWalker::walk(const std::string &root, const BatchCallback &emit) {
+    std::error_code ec;
+    if (!fs::is_directory(root, ec)) {
+        throw std::runtime_error("fail to open directory " + root);
+    }
+
+    Walk walk(options_, emit, root);
+    std::shared_ptr<IgnoreList> extra;
+    if (!options_.ignore.empty()) {
+        extra = std::make_shared<IgnoreList>();
+        for (const std::string &pattern : options_.ignore) add_rule(*extra, pattern);
+    }
+    walk.pending.push_back(Walk::Dir{"", extra});
+
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < options_.threads; i++) {
+        threads.emplace_back(&Walk::run, &walk);
+    }
+    walk.run();
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+
+    if (walk.error) std::rethrow_exception(walk.error);
+    return walk.found;
+}
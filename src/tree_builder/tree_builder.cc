@@ -6,6 +6,134 @@
 #include <tree_sitter/tree-sitter-javascript.h>
 #include <tree_sitter/tree-sitter-tsx.h>
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <utility>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+// Files up to this size are read into memory, larger ones are mapped.
+static const size_t kMapThreshold = 64 * 1024;
+
+// Compiled queries by language and text, shared by all builders and threads.
+// A TSQuery does not change once built, so they live as long as the process.
+typedef std::unique_ptr<TSQuery, void (*)(TSQuery *)> QueryPtr;
+static std::shared_mutex query_mutex;
+static std::map<std::pair<const TSLanguage *, std::string>, QueryPtr> queries;
+
+// Cursor of the calling thread, reused by every query it runs.
+static TSQueryCursor *thread_cursor() {
+    thread_local std::unique_ptr<TSQueryCursor, void (*)(TSQueryCursor *)> cursor(
+        ts_query_cursor_new(), ts_query_cursor_delete);
+    return cursor.get();
+}
+
+SourceFile::SourceFile(const char *path) : data_(""), size_(0), mapped_(false) {
+#ifdef _WIN32
+    int size_needed = MultiByteToWideChar(CP_UTF8, 0, path, -1, NULL, 0);
+    std::vector<wchar_t> wpath(size_needed);
+    MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath.data(), size_needed);
+    HANDLE file = CreateFileW(wpath.data(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        throw std::runtime_error(std::string("fail to open ") + path);
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size)) {
+        CloseHandle(file);
+        throw std::runtime_error(std::string("fail to stat ") + path);
+    }
+    size_ = static_cast<size_t>(file_size.QuadPart);
+    if (size_ > kMapThreshold) {
+        HANDLE mapping = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping != NULL) {
+            void *view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+            if (view != NULL) {
+                data_ = static_cast<const char *>(view);
+                mapped_ = true;
+            }
+        }
+    }
+    if (!mapped_ && size_ > 0) {
+        buffer_.resize(size_);
+        size_t done = 0;
+        DWORD n = 0;
+        while (done < size_ &&
+               ReadFile(file, buffer_.data() + done,
+                        static_cast<DWORD>(std::min<size_t>(size_ - done, 1 << 30)), &n,
+                        NULL) &&
+               n > 0) {
+            done += n;
+        }
+        size_ = done;
+        data_ = buffer_.data();
+    }
+    CloseHandle(file);
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        throw std::runtime_error(std::string("fail to open ") + path);
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error(std::string("fail to stat ") + path);
+    }
+    size_ = static_cast<size_t>(st.st_size);
+    if (size_ > kMapThreshold) {
+        void *addr = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            // The parser reads front to back.
+            madvise(addr, size_, MADV_SEQUENTIAL);
+            data_ = static_cast<const char *>(addr);
+            mapped_ = true;
+        }
+    }
+    if (!mapped_ && size_ > 0) {
+        // The file may change meanwhile, keep what could be read.
+        buffer_.resize(size_);
+        size_t done = 0;
+        while (done < size_) {
+            ssize_t n = read(fd, buffer_.data() + done, size_ - done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        size_ = done;
+        data_ = buffer_.data();
+    }
+    close(fd);
+#endif
+}
+
+SourceFile::SourceFile(SourceFile &&other) noexcept
+    : data_(other.data_),
+      size_(other.size_),
+      mapped_(other.mapped_),
+      buffer_(std::move(other.buffer_)) {
+    if (!mapped_ && size_ > 0) data_ = buffer_.data();
+    other.data_ = "";
+    other.size_ = 0;
+    other.mapped_ = false;
+}
+
+SourceFile::~SourceFile() {
+    if (!mapped_) return;
+#ifdef _WIN32
+    UnmapViewOfFile(data_);
+#else
+    munmap(const_cast<char *>(data_), size_);
+#endif
+}
+
 TreeBuilder::TreeBuilder(const Language lang) {
     TSParser *_parser = ts_parser_new();
     const TSLanguage *_language;
@@ -54,6 +182,15 @@ FilePayload TreeBuilder::load_file_to_payload(FILE *file) {
     return payload;
 }
 
+void TreeBuilder::free_payload(FilePayload *payload) {
+    free(payload->buffer);
+    payload->buffer = NULL;
+    if (payload->file != NULL) {
+        fclose(payload->file);
+        payload->file = NULL;
+    }
+}
+
 TSInput TreeBuilder::construct_parser_input(FilePayload *payload) {
     TSInput input = {
         .payload = payload,
@@ -68,6 +205,22 @@ TSTree *TreeBuilder::build_tree(TSInput input) {
     return ts_parser_parse(parser, NULL, input);
 }
 
+TSTree *TreeBuilder::build_tree(const SourceFile &source) {
+    if (source.size() > UINT32_MAX) {
+        throw std::length_error("file is too large to parse");
+    }
+    return ts_parser_parse_string(parser, NULL, source.data(),
+                                  static_cast<uint32_t>(source.size()));
+}
+
+TSTree *TreeBuilder::reparse(TSTree *old_tree, const std::string &text) {
+    if (text.size() > UINT32_MAX) {
+        throw std::length_error("file is too large to parse");
+    }
+    return ts_parser_parse_string(parser, old_tree, text.data(),
+                                  static_cast<uint32_t>(text.size()));
+}
+
 void TreeBuilder::delete_tree(TSTree *tree) {
     ts_tree_delete(tree);
 }
@@ -83,24 +236,129 @@ void TreeBuilder::print(TSTree *tree) {
     free(tree_string);
 }
 
-std::vector<TSPoint> TreeBuilder::query(TSTree *tree, const std::string &query_str) {
+const TSQuery *TreeBuilder::compile_query(const std::string &query_str) {
+    auto key = std::make_pair(language, query_str);
+    {
+        std::shared_lock<std::shared_mutex> lock(query_mutex);
+        auto it = queries.find(key);
+        if (it != queries.end()) return it->second.get();
+    }
+
+    // Compile without the lock, a thread which got there first wins.
     uint32_t error_offset = 0;
     TSQueryError error_type = TSQueryErrorNone;
-    TSQuery *query = ts_query_new(tree_sitter_tsx(), query_str.c_str(),
-                                    strlen(query_str.c_str()), &error_offset, &error_type);
-    if (error_type != TSQueryErrorNone) {
-        throw std::runtime_error("fail to create new query");
+    QueryPtr query(ts_query_new(language, query_str.c_str(), query_str.size(),
+                                &error_offset, &error_type),
+                   ts_query_delete);
+    if (error_type != TSQueryErrorNone || !query) {
+        throw std::runtime_error("fail to create new query at offset " +
+                                 std::to_string(error_offset));
     }
-    TSQueryCursor *cursor = ts_query_cursor_new();
+    std::unique_lock<std::shared_mutex> lock(query_mutex);
+    return queries.emplace(std::move(key), std::move(query)).first->second.get();
+}
+
+std::vector<TSPoint> TreeBuilder::query(TSTree *tree, const std::string &query_str) {
+    const TSQuery *query = compile_query(query_str);
+    TSQueryCursor *cursor = thread_cursor();
     ts_query_cursor_exec(cursor, query, ts_tree_root_node(tree));
 
     TSQueryMatch match;
     uint32_t index;
     std::vector<TSPoint> result;
     while (ts_query_cursor_next_capture(cursor, &match, &index)) {
-        TSPoint point = ts_node_start_point(match.captures->node);
+        TSPoint point = ts_node_start_point(match.captures[index].node);
         result.push_back(point);
     }
 
     return result;
-}
\ No newline at end of file
+}
+
+// Position after walking over size bytes of data from point.
+static TSPoint advance(TSPoint point, const char *data, size_t size) {
+    const char *end = data + size;
+    const char *p;
+    while ((p = static_cast<const char *>(memchr(data, '\n', end - data))) != NULL) {
+        point.row++;
+        point.column = 0;
+        data = p + 1;
+    }
+    point.column += static_cast<uint32_t>(end - data);
+    return point;
+}
+
+OpenFile::OpenFile(TreeBuilder &builder, std::string text)
+    : builder_(builder), text_(std::move(text)), tree_(NULL) {
+    tree_ = builder_.reparse(NULL, text_);
+    if (tree_ == NULL) {
+        throw std::runtime_error("fail to parse file");
+    }
+}
+
+OpenFile::OpenFile(TreeBuilder &builder, const SourceFile &source)
+    : OpenFile(builder, std::string(source.data(), source.size())) {}
+
+OpenFile::~OpenFile() {
+    ts_tree_delete(tree_);
+}
+
+std::vector<TSRange> OpenFile::edit(uint32_t start, uint32_t old_end, const std::string &text) {
+    if (start > old_end || old_end > text_.size()) {
+        throw std::out_of_range("edit is outside of the file");
+    }
+    if (text_.size() - (old_end - start) + text.size() > UINT32_MAX) {
+        throw std::length_error("file is too large to parse");
+    }
+
+    TSInputEdit input_edit;
+    input_edit.start_byte = start;
+    input_edit.old_end_byte = old_end;
+    input_edit.new_end_byte = start + static_cast<uint32_t>(text.size());
+    input_edit.start_point = advance(TSPoint{0, 0}, text_.data(), start);
+    input_edit.old_end_point =
+        advance(input_edit.start_point, text_.data() + start, old_end - start);
+    input_edit.new_end_point = advance(input_edit.start_point, text.data(), text.size());
+
+    // Work on a copy of text and tree, the file stays as it was if the
+    // reparse fails.
+    std::string new_text(text_);
+    new_text.replace(start, old_end - start, text);
+    TSTree *old_tree = ts_tree_copy(tree_);
+    ts_tree_edit(old_tree, &input_edit);
+    TSTree *tree = builder_.reparse(old_tree, new_text);
+    if (tree == NULL) {
+        ts_tree_delete(old_tree);
+        throw std::runtime_error("fail to reparse file");
+    }
+
+    uint32_t count = 0;
+    TSRange *changed = ts_tree_get_changed_ranges(old_tree, tree, &count);
+    ts_tree_delete(old_tree);
+    ts_tree_delete(tree_);
+    tree_ = tree;
+    text_.swap(new_text);
+
+    // Changed ranges only cover syntax, an edit inside a token (a renamed
+    // identifier) leaves the structure alone, so the edit itself goes in too.
+    std::vector<TSRange> ranges(changed, changed + count);
+    free(changed);
+    TSRange edited = {input_edit.start_point, input_edit.new_end_point,
+                      input_edit.start_byte, input_edit.new_end_byte};
+    ranges.push_back(edited);
+    std::sort(ranges.begin(), ranges.end(), [](const TSRange &a, const TSRange &b) {
+        return a.start_byte < b.start_byte;
+    });
+
+    std::vector<TSRange> merged;
+    for (const TSRange &range : ranges) {
+        if (!merged.empty() && range.start_byte <= merged.back().end_byte) {
+            if (range.end_byte > merged.back().end_byte) {
+                merged.back().end_byte = range.end_byte;
+                merged.back().end_point = range.end_point;
+            }
+        } else {
+            merged.push_back(range);
+        }
+    }
+    return merged;
+}
@@ -0,0 +1,294 @@
+#include <bptree/bptree.hpp>
+
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+// A failed check is reported and the test goes on, main() fails at the end.
+static int failures = 0;
+
+#define CHECK(cond)                                                       \
+    do {                                                                  \
+        if (!(cond)) {                                                    \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " << #cond    \
+                      << std::endl;                                       \
+            ++failures;                                                   \
+        }                                                                 \
+    } while (0)
+
+#define CHECK_THROWS(expr, type)                                          \
+    do {                                                                  \
+        bool thrown = false;                                              \
+        try {                                                             \
+            expr;                                                         \
+        } catch (const type &) {                                          \
+            thrown = true;                                                \
+        }                                                                 \
+        if (!thrown) {                                                    \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": " << #expr    \
+                      << " did not throw " << #type << std::endl;         \
+            ++failures;                                                   \
+        }                                                                 \
+    } while (0)
+
+// Data file of the running test, it and its log are removed around each.
+static std::string path;
+
+static void remove_files() {
+    unlink(path.c_str());
+    unlink((path + "-wal").c_str());
+}
+
+static std::string key(int i) {
+    char buf[16];
+    snprintf(buf, sizeof(buf), "key%06d", i);
+    return buf;
+}
+
+static void copy_file(const std::string &from, const std::string &to) {
+    FILE *in = fopen(from.c_str(), "rb");
+    FILE *out = fopen(to.c_str(), "wb");
+    if (in == NULL || out == NULL) {
+        perror("fopen");
+        exit(1);
+    }
+    char buf[1 << 16];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) fwrite(buf, 1, n, out);
+    fclose(in);
+    fclose(out);
+}
+
+// Run `body` in a child process which exits without running destructors,
+// as a crash would.
+static void crash_after(const std::function<void()> &body) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        body();
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(pid, &status, 0);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void test_replays_log_after_crash() {
+    {
+        BPlusTree tree(path.c_str());
+        for (int i = 0; i < 1000; ++i) tree.upsert(key(i), "old");
+    }
+    // The data file as it was before the batch reached it.
+    const std::string backup = path + ".bak";
+    copy_file(path, backup);
+
+    crash_after([] {
+        BPlusTree tree(path.c_str());
+        WriteBatch batch;
+        for (int i = 0; i < 1000; i += 2) batch.upsert(key(i), "new");
+        for (int i = 1000; i < 1500; ++i) batch.upsert(key(i), std::string(600, 'v'));
+        batch.remove(key(1));
+        tree.write(batch);
+    });
+    copy_file(backup, path);
+    unlink(backup.c_str());
+    // A torn record at the end of the log is left out.
+    FILE *wal = fopen((path + "-wal").c_str(), "ab");
+    CHECK(wal != NULL);
+    if (wal != NULL) {
+        fputs("torn", wal);
+        fclose(wal);
+    }
+
+    BPlusTree tree(path.c_str());
+    std::string value;
+    CHECK(tree.get(key(0), value) && value == "new");
+    CHECK(tree.get(key(3), value) && value == "old");
+    CHECK(!tree.get(key(1), value));
+    CHECK(tree.get(key(1499), value) && value == std::string(600, 'v'));
+    CHECK(tree.size() == 1499);
+    CHECK(tree.verify().empty());
+}
+
+static void test_shadow_keeps_commits_after_crash() {
+    BPlusTree::Options options;
+    options.mode = BPlusTree::CommitMode::kShadow;
+    crash_after([&] {
+        BPlusTree tree(path.c_str(), options);
+        for (int i = 0; i < 2000; ++i) tree.upsert(key(i), "v");
+        for (int i = 0; i < 2000; i += 4) tree.remove(key(i));
+    });
+
+    BPlusTree tree(path.c_str(), options);
+    std::string value;
+    CHECK(tree.size() == 1500);
+    CHECK(!tree.get(key(0), value));
+    CHECK(tree.get(key(1), value) && value == "v");
+    CHECK(tree.verify().empty());
+}
+
+static void test_failed_batch_applies_nothing() {
+    BPlusTree tree(path.c_str());
+    tree.upsert("plain", "abc");
+    WriteBatch batch;
+    batch.upsert("a", "1");
+    batch.append_posting("plain", 5);
+    batch.upsert("z", "2");
+    CHECK_THROWS(tree.write(batch), std::invalid_argument);
+
+    std::string value;
+    CHECK(!tree.get("a", value));
+    CHECK(!tree.get("z", value));
+    WriteBatch next;
+    next.upsert("b", "3");
+    tree.write(next);
+    CHECK(tree.get("b", value));
+    CHECK(tree.size() == 2);
+}
+
+static void test_postings_round_trip() {
+    BPlusTree tree(path.c_str());
+    std::vector<uint64_t> expected;
+    // Long enough to spill to overflow pages.
+    for (uint64_t p = 1; p < 20000; p += 3) {
+        CHECK(tree.append_posting("symbol", p));
+        expected.push_back(p);
+    }
+    CHECK(!tree.append_posting("symbol", 4));
+    CHECK(tree.append_posting("symbol", 5));
+    expected.insert(expected.begin() + 2, 5);
+    CHECK(tree.remove_posting("symbol", 1));
+    expected.erase(expected.begin());
+    CHECK(!tree.remove_posting("symbol", 2));
+
+    std::vector<uint64_t> postings;
+    CHECK(tree.get_postings("symbol", postings) && postings == expected);
+
+    WriteBatch batch;
+    batch.append_posting("short", 7);
+    batch.append_posting("short", 3);
+    tree.write(batch);
+    CHECK(tree.get_postings("short", postings) &&
+          postings == std::vector<uint64_t>({3, 7}));
+    CHECK(tree.remove_posting("short", 3));
+    CHECK(tree.remove_posting("short", 7));
+    CHECK(!tree.get_postings("short", postings));
+
+    // A plain value is never taken for a posting list.
+    const std::string plain(100, 'x');
+    tree.upsert("plain", plain);
+    CHECK_THROWS(tree.append_posting("plain", ~0ull), std::invalid_argument);
+    CHECK_THROWS(tree.get_postings("plain", postings), std::invalid_argument);
+    std::string value;
+    CHECK(tree.get("plain", value) && value == plain);
+    CHECK(tree.verify().empty());
+}
+
+static void test_cursor_prefix_and_limit() {
+    BPlusTree tree(path.c_str());
+    for (int i = 0; i < 3000; ++i) tree.upsert(key(i), std::to_string(i));
+    tree.upsert("other", "x");
+
+    std::vector<std::string> keys;
+    for (BPlusTree::Cursor c = tree.scan_prefix("key0012"); c.valid(); c.next()) {
+        keys.emplace_back(c.key());
+    }
+    CHECK(keys.size() == 100);
+    CHECK(!keys.empty() && keys.front() == key(1200) && keys.back() == key(1299));
+
+    keys.clear();
+    for (BPlusTree::Cursor c = tree.scan_prefix("key", 5, true); c.valid(); c.next()) {
+        keys.emplace_back(c.key());
+    }
+    CHECK(keys == std::vector<std::string>(
+                      {key(2999), key(2998), key(2997), key(2996), key(2995)}));
+
+    int n = 0;
+    for (BPlusTree::Cursor c = tree.scan(key(10), key(20), 4); c.valid(); c.next()) {
+        CHECK(c.key() == key(10 + n));
+        CHECK(c.value() == std::to_string(10 + n));
+        ++n;
+    }
+    CHECK(n == 4);
+    CHECK(!tree.scan_prefix("none").valid());
+}
+
+static void test_verify_compacted_tree() {
+    for (BPlusTree::CommitMode mode :
+         {BPlusTree::CommitMode::kLog, BPlusTree::CommitMode::kShadow}) {
+        remove_files();
+        BPlusTree::Options options;
+        options.mode = mode;
+        options.bloom_bits_per_key = 10;
+        BPlusTree tree(path.c_str(), options);
+        for (int i = 0; i < 20000; ++i) {
+            tree.upsert(key(i * 7919 % 20000), std::string(i % 50 == 0 ? 1000 : 20, 'v'));
+        }
+        for (int i = 0; i < 20000; i += 3) tree.remove(key(i));
+        tree.append_posting("symbol", 42);
+        tree.compact();
+
+        CHECK(tree.verify().empty());
+        CHECK(tree.size() == 13334);
+        std::string value;
+        int wrong = 0;
+        for (int i = 0; i < 20000; ++i) {
+            if (tree.get(key(i), value) != (i % 3 != 0)) ++wrong;
+        }
+        CHECK(wrong == 0);
+        std::vector<uint64_t> postings;
+        CHECK(tree.get_postings("symbol", postings) &&
+              postings == std::vector<uint64_t>({42}));
+    }
+}
+
+static void test_filter_keeps_up_with_churn() {
+    BPlusTree::Options options;
+    options.bloom_bits_per_key = 10;
+    BPlusTree tree(path.c_str(), options);
+    // The key count stays the same while keys come and go.
+    for (int round = 0; round < 20; ++round) {
+        for (int i = 0; i < 1000; ++i) tree.upsert(key(round * 1000 + i), "v");
+        if (round > 0) {
+            for (int i = 0; i < 1000; ++i) tree.remove(key((round - 1) * 1000 + i));
+        }
+    }
+    CHECK(tree.size() == 1000);
+    std::string value;
+    int missing = 0;
+    for (int i = 19000; i < 20000; ++i) missing += !tree.get(key(i), value);
+    CHECK(missing == 0);
+    CHECK(!tree.get(key(0), value));
+    CHECK(tree.verify().empty());
+}
+
+int main() {
+    const std::pair<const char *, void (*)()> tests[] = {
+        {"replays_log_after_crash", test_replays_log_after_crash},
+        {"shadow_keeps_commits_after_crash", test_shadow_keeps_commits_after_crash},
+        {"failed_batch_applies_nothing", test_failed_batch_applies_nothing},
+        {"postings_round_trip", test_postings_round_trip},
+        {"cursor_prefix_and_limit", test_cursor_prefix_and_limit},
+        {"verify_compacted_tree", test_verify_compacted_tree},
+        {"filter_keeps_up_with_churn", test_filter_keeps_up_with_churn},
+    };
+    for (const auto &test : tests) {
+        path = std::string("bptree_test_") + test.first + ".db";
+        remove_files();
+        int before = failures;
+        test.second();
+        remove_files();
+        std::cout << (failures == before ? "ok   " : "FAIL ") << test.first << std::endl;
+    }
+    return failures == 0 ? 0 : 1;
+}